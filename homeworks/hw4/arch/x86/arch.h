@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include "context_switch.h"
 #include "syscall.h"
+#include "x86.h"
 
 void arch_init();
 
@@ -47,7 +48,37 @@ static inline void irq_enable() {
     __asm__ volatile ("sti");
 }
 
+// irq_save disables interrupts and returns previous rflags, which should be passed to irq_restore later.
+static inline uint64_t irq_save() {
+    uint64_t rflags;
+    __asm__ volatile (
+        "pushfq\n"
+        "pop %0\n"
+        "cli"
+        : "=r"(rflags)
+        :
+        : "memory"
+    );
+    return rflags;
+}
+
+// irq_restore enables interrupts back if they were enabled at the time of the matching irq_save.
+static inline void irq_restore(uint64_t rflags) {
+    if (rflags & RFLAGS_IF) {
+        irq_enable();
+    }
+}
+
+// arch_cpu_id returns index of the current CPU. Only the bootstrap processor is brought up for now, so it's always 0
+// and per-CPU state beyond the first of MAX_CPUS slots stays unused.
+static inline unsigned arch_cpu_id() {
+    return 0;
+}
+
 int arch_thread_new(arch_thread_t* thread, arch_regs_t** regs);
 int arch_thread_clone(arch_thread_t* dst, arch_regs_t** regs, arch_thread_t* src);
+// arch_regs_init_fork fills registers of a forked thread from registers saved at the parent's fork syscall.
+// The child sees 0 as the syscall result.
+void arch_regs_init_fork(arch_regs_t* dst, arch_regs_t* src);
 void arch_thread_destroy(arch_thread_t* thread);
 void arch_thread_switch(arch_thread_t* prev, arch_thread_t* next);
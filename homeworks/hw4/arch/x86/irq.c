@@ -1,8 +1,11 @@
 #include "irq.h"
+#include "kernel/errno.h"
 #include "kernel/panic.h"
 #include "sched/sched.h"
 #include "arch/x86/x86.h"
 #include "arch/x86/arch.h"
+#include "arch/x86/uaccess.h"
+#include "linker.h"
 #include "drivers/apic.h"
 
 void timer_handler() {
@@ -21,7 +24,50 @@ void spurious_handler() {
 #define PF_ERRCODE_I    (1<<4)
 #define PF_ERRCODE_PK   (1<<5)
 
+// extable_find returns the fixup address for a faulting kernel instruction at rip, or 0 if there is none.
+// The table is small and only searched on faults which would panic otherwise, so a linear scan is enough.
+static uint64_t extable_find(uint64_t rip) {
+    const x86_extable_entry_t* entry = (const x86_extable_entry_t*)&_ex_table_start;
+    const x86_extable_entry_t* end = (const x86_extable_entry_t*)&_ex_table_end;
+    for (; entry < end; entry++) {
+        if (entry->insn == rip) {
+            return entry->fixup;
+        }
+    }
+    return 0;
+}
+
 void pf_handler(arch_regs_t* ctx) {
+    void* addr = (void*)x86_read_cr2();
+
+    // Faults on user memory: both from user mode and from the kernel on behalf of a task.
+    if (sched_current() != NULL) {
+        uint64_t fault_flags = 0;
+        if (ctx->errcode & PF_ERRCODE_P) {
+            fault_flags |= VMEM_FAULT_PRESENT;
+        }
+        if (ctx->errcode & PF_ERRCODE_W) {
+            fault_flags |= VMEM_FAULT_WRITE;
+        }
+        // The kernel touches user memory only on behalf of the task, so it gets the same permissions.
+        if ((ctx->errcode & PF_ERRCODE_U) || (uint64_t)addr < USER_SPACE_END) {
+            fault_flags |= VMEM_FAULT_USER;
+        }
+
+        if (vmem_handle_fault(&sched_current()->vmem, addr, fault_flags) == 0) {
+            return;
+        }
+    }
+
+    // Bad user pointers passed to the kernel end up here from the uaccess routines, which recover from the fault.
+    if (!(ctx->errcode & PF_ERRCODE_U)) {
+        uint64_t fixup = extable_find(ctx->rip);
+        if (fixup != 0) {
+            ctx->rip = fixup;
+            return;
+        }
+    }
+
     char reason[64];
     size_t pos = 0;
 
@@ -45,7 +91,13 @@ void pf_handler(arch_regs_t* ctx) {
     if (pos > 0) {
         reason[pos - 1] = '\0';
     }
-    panic("pagefault [%s]: addr=%p, rip=%p", reason, x86_read_cr2(), ctx->rip);
+
+    // Bad accesses from user mode only take down the task, with an exit code sys_exit can't produce.
+    if ((ctx->errcode & PF_ERRCODE_U) && sched_current() != NULL) {
+        printk("pagefault [%s]: addr=%p, rip=%p, killing task %d\n", reason, addr, ctx->rip, (int)sched_current()->pid);
+        sched_exit(-EFAULT);
+    }
+    panic("pagefault [%s]: addr=%p, rip=%p", reason, addr, ctx->rip);
 }
 
 void gp_handler(arch_regs_t* ctx) {
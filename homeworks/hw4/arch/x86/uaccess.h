@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// x86_extable_entry is an entry of the exception table: a page fault raised by the kernel at insn
+// resumes at fixup. Entries are emitted into the __ex_table section next to the instructions they cover.
+typedef struct {
+    uint64_t insn;
+    uint64_t fixup;
+} x86_extable_entry_t;
+
+// x86_copy_user copies size bytes from src to dst, either of which may be a user address.
+// Returns the number of bytes left uncopied when a page fault stops the copy, 0 on success.
+size_t x86_copy_user(void* dst, const void* src, size_t size);
@@ -101,6 +101,19 @@ void arch_init() {
     load_tss();
     syscall_init();
     irq_init();
+
+    // Make kernel writes to read-only user pages fault as well, copy-on-write relies on it.
+    x86_write_cr0(x86_read_cr0() | CR0_WP);
+
+    // Keep global kernel mappings in TLB across CR3 writes.
+    x86_write_cr4(x86_read_cr4() | CR4_PGE);
+
+    // Tag TLB entries with address space identifiers, see vmem_switch_to. The boot CR3 has PCID 0, as required.
+    uint32_t regs[4];
+    x86_cpuid(1, 0, regs);
+    if (regs[2] & CPUID_1_ECX_PCID) {
+        x86_write_cr4(x86_read_cr4() | CR4_PCIDE);
+    }
 }
 
 void arch_thread_switch(arch_thread_t* prev, arch_thread_t* next) {
@@ -109,11 +122,10 @@ void arch_thread_switch(arch_thread_t* prev, arch_thread_t* next) {
 }
 
 static int allocate_kstack(arch_thread_t* th) {
-    th->kstack_top = frame_alloc();
+    th->kstack_top = frame_alloc(FRAME_ZERO);
     if (th->kstack_top == NULL) {
         return -ENOMEM;
     }
-    memset(th->kstack_top, '\0', PAGE_SIZE);
     th->kstack_top += PAGE_SIZE;
     return 0;
 }
@@ -167,6 +179,14 @@ int arch_thread_clone(arch_thread_t* dst, arch_regs_t** regs, arch_thread_t* src
     return 0;
 }
 
+void arch_regs_init_fork(arch_regs_t* dst, arch_regs_t* src) {
+    arch_regs_copy(dst, src);
+    // Syscall entry saves kernel segments, the child returns to user mode through iret.
+    dst->cs = GDT_SEGMENT_SELECTOR(USER_CODE_SEG, RPL_RING3);
+    dst->ss = GDT_SEGMENT_SELECTOR(USER_DATA_SEG, RPL_RING3);
+    arch_regs_set_retval(dst, 0);
+}
+
 void arch_thread_destroy(arch_thread_t* th) {
     frame_free(th->kstack_top - PAGE_SIZE);
 }
@@ -4,6 +4,33 @@
 
 #define RFLAGS_IF (1<<9)
 
+#define CR0_WP (1<<16)
+
+#define CR4_PGE   (1<<7)
+#define CR4_PCIDE (1<<17)
+
+// With CR4.PCIDE, low bits of CR3 hold PCID, and setting the top bit on write keeps TLB entries of that PCID.
+#define CR3_PCID_MASK 0xfffull
+#define CR3_NOFLUSH   (1ull << 63)
+
+#define CPUID_1_ECX_PCID (1<<17)
+
+static inline uint64_t x86_read_cr0() {
+    uint64_t ret;
+    __asm__ volatile (
+        "mov %%cr0, %0"
+        : "=r"(ret)
+    );
+    return ret;
+}
+
+static inline void x86_write_cr0(uint64_t x) {
+    __asm__ volatile (
+        "mov %0, %%cr0"
+        : : "r"(x)
+    );
+}
+
 static inline uint64_t x86_read_cr2() {
     uint64_t ret;
     __asm__ volatile (
@@ -29,6 +56,78 @@ static inline void x86_write_cr3(uint64_t x) {
     );
 }
 
+static inline uint64_t x86_read_cr4() {
+    uint64_t ret;
+    __asm__ volatile (
+        "mov %%cr4, %0"
+        : "=r"(ret)
+    );
+    return ret;
+}
+
+static inline void x86_write_cr4(uint64_t x) {
+    __asm__ volatile (
+        "mov %0, %%cr4"
+        : : "r"(x) : "memory"
+    );
+}
+
+// x86_flush_tlb_all drops all TLB entries, including global ones and ones tagged with any PCID.
+static inline void x86_flush_tlb_all() {
+    // Any change of CR4.PGE flushes the whole TLB.
+    const uint64_t cr4 = x86_read_cr4();
+    x86_write_cr4(cr4 ^ CR4_PGE);
+    x86_write_cr4(cr4);
+}
+
+// x86_cpuid executes CPUID for the given leaf and stores EAX, EBX, ECX and EDX to regs.
+static inline void x86_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __asm__ volatile (
+        "cpuid"
+        : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+        : "a"(leaf), "c"(subleaf)
+    );
+}
+
+// x86_invlpg drops TLB entries of the page containing addr.
+static inline void x86_invlpg(void* addr) {
+    __asm__ volatile (
+        "invlpg (%0)"
+        : : "r"(addr) : "memory"
+    );
+}
+
+// x86_rdtsc returns the time stamp counter.
+static inline uint64_t x86_rdtsc() {
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ volatile (
+        "rdtsc"
+        : "=a"(lo), "=d"(hi)
+    );
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// x86_stosq fills cnt quadwords starting at dst with val.
+static inline void x86_stosq(void* dst, uint64_t val, size_t cnt) {
+    __asm__ volatile (
+        "rep stosq"
+        : "+D"(dst), "+c"(cnt)
+        : "a"(val)
+        : "memory"
+    );
+}
+
+// x86_movsq copies cnt quadwords from src to dst.
+static inline void x86_movsq(void* dst, const void* src, size_t cnt) {
+    __asm__ volatile (
+        "rep movsq"
+        : "+D"(dst), "+S"(src), "+c"(cnt)
+        :
+        : "memory"
+    );
+}
+
 static inline void x86_hlt() {
     __asm__ volatile ("hlt");
 }
@@ -37,7 +37,7 @@ static EARLY_TEXT void early_setup_paging() {
         uint64_t phys_addr = i * 512 * GB;
         uint64_t virt_addr = KERNEL_DIRECT_PHYS_MAPPING_START + phys_addr;
         for (size_t j = 0; j < 512; j++) {
-            direct_phys_mapping_pdpts[i].entries[j] = phys_addr | PTE_PAGE_SIZE | PTE_PRESENT | PTE_WRITE;
+            direct_phys_mapping_pdpts[i].entries[j] = phys_addr | PTE_PAGE_SIZE | PTE_PRESENT | PTE_WRITE | PTE_GLOBAL;
             phys_addr += GB;
         }
         uint64_t pml4e = ((uint64_t)&direct_phys_mapping_pdpts[i]) | PTE_PRESENT | PTE_WRITE;
@@ -51,7 +51,7 @@ static EARLY_TEXT void early_setup_paging() {
     uint64_t phys_addr_end = (uint64_t)&_phys_end_kernel_sections;
     while (phys_addr_curr < phys_addr_end) {
         size_t pgdir_idx = PDPE_FROM_ADDR(virt_addr_curr) - PDPE_FROM_ADDR(virt_addr_start);
-        higher_half_pgdirs[pgdir_idx].entries[PDE_FROM_ADDR(virt_addr_curr)] = phys_addr_curr | PTE_PAGE_SIZE | PTE_PRESENT | PTE_WRITE;
+        higher_half_pgdirs[pgdir_idx].entries[PDE_FROM_ADDR(virt_addr_curr)] = phys_addr_curr | PTE_PAGE_SIZE | PTE_PRESENT | PTE_WRITE | PTE_GLOBAL;
         phys_addr_curr += 2 * MB;
         virt_addr_curr += 2 * MB;
         higher_half_pdpt.entries[PDPE_FROM_ADDR(virt_addr_curr)] = ((uint64_t)&higher_half_pgdirs[pgdir_idx]) | PTE_PRESENT | PTE_WRITE;
@@ -3,6 +3,7 @@
 #include "types.h"
 
 #define ALIGN_UP(X, R) ((((uint64_t)X) + (R) - 1) / (R) * (R))
+#define ALIGN_DOWN(X, R) (((uint64_t)X) / (R) * (R))
 #define DIV_ROUNDUP(X, R) ((((uint64_t)X) + (R) - 1) / (R))
 #define UNUSED(x) (void)(x)
 
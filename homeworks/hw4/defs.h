@@ -4,10 +4,15 @@
 
 #define CACHE_LINE_SIZE_BYTES 64
 
+#define MAX_CPUS 16
+
 #define GB (1 << 30)
 #define MB (1 << 20)
 #define KB (1 << 10)
 
+// User space takes the lower half of the address space.
+#define USER_SPACE_END           0x0000800000000000
+
 #define KERNEL_HIGHER_HALF_START 0xffff800000000000
 
 #define KERNEL_SECTIONS_START    0xffffffff80000000
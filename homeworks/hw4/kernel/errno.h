@@ -3,3 +3,4 @@
 #define ENOSYS 1
 #define ENOMEM 2
 #define EINVAL 3
+#define EFAULT 4
@@ -51,6 +51,10 @@ void kernel_main(early_data_t* early_data) {
     dump_mmap();
 
     frame_alloc_init();
+#ifdef FRAME_ALLOC_BENCH
+    frame_alloc_bench();
+#endif
+    vmem_init_kernel();
 
     sched_start();
 }
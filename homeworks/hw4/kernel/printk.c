@@ -111,6 +111,10 @@ void vprintk(const char *fmt, va_list args) {
                 vga_writestring_color(str, color);
                 size = 0;
                 break;
+            case '%':
+                buf[0] = '%';
+                size = 1;
+                break;
             default:
                 size = 0;
                 break;
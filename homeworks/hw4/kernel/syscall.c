@@ -4,12 +4,23 @@
 #include "kernel/panic.h"
 #include "arch/x86/arch.h"
 #include "common.h"
+#include "mm/frame_alloc.h"
 
 int64_t sys_sleep(arch_regs_t* regs);
 int64_t sys_fork(arch_regs_t* regs);
 int64_t sys_getpid(arch_regs_t* regs);
 int64_t sys_exit(arch_regs_t* regs);
 int64_t sys_wait(arch_regs_t* regs);
+int64_t sys_mmap(arch_regs_t* regs);
+int64_t sys_munmap(arch_regs_t* regs);
+int64_t sys_mprotect(arch_regs_t* regs);
+
+// sys_memstat prints allocator counters to the kernel log. Meant for debugging.
+static int64_t sys_memstat(arch_regs_t* regs) {
+    UNUSED(regs);
+    frame_alloc_dump_pcp_stats();
+    return 0;
+}
 
 syscall_fn_t syscall_table[] = {
     [SYS_SLEEP] = sys_sleep,
@@ -17,6 +28,10 @@ syscall_fn_t syscall_table[] = {
     [SYS_GETPID] = sys_getpid,
     [SYS_EXIT] = sys_exit,
     [SYS_WAIT] = sys_wait,
+    [SYS_MMAP] = sys_mmap,
+    [SYS_MUNMAP] = sys_munmap,
+    [SYS_MPROTECT] = sys_mprotect,
+    [SYS_MEMSTAT] = sys_memstat,
 };
 
 uint64_t do_syscall(uint64_t sysno, arch_regs_t* regs) {
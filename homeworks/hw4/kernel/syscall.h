@@ -9,6 +9,10 @@ enum {
     SYS_GETPID = 2,
     SYS_EXIT = 3,
     SYS_WAIT = 4,
+    SYS_MMAP = 5,
+    SYS_MUNMAP = 6,
+    SYS_MPROTECT = 7,
+    SYS_MEMSTAT = 8,
     SYS_MAX,
 };
 
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defs.h"
+#include "kernel/errno.h"
+#include "arch/x86/uaccess.h"
+
+/**
+ * Pointers passed by user space are only checked to lie in the lower half of the address space.
+ * Whether the pages behind them are mapped is found out by touching them: the page fault handler
+ * populates them as for any user access, and if that fails, the faulting copy instruction is
+ * looked up in the exception table and resumed at its fixup, which reports the error back.
+ * So a good pointer costs a single comparison instead of an area tree walk, and a pointer
+ * unmapped by another thread between a check and the access can't crash the kernel.
+ */
+
+// access_ok checks that size bytes at addr lie entirely in user space.
+static inline bool access_ok(const void* addr, size_t size) {
+    return (uint64_t)addr <= USER_SPACE_END && size <= USER_SPACE_END - (uint64_t)addr;
+}
+
+// copy_to_user copies size bytes from kernel memory at src to user memory at dst.
+// Returns 0 on success, -EFAULT if dst is not valid user memory.
+static inline int copy_to_user(void* dst, const void* src, size_t size) {
+    if (!access_ok(dst, size) || x86_copy_user(dst, src, size) != 0) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+// copy_from_user copies size bytes from user memory at src to kernel memory at dst.
+// Returns 0 on success, -EFAULT if src is not valid user memory.
+static inline int copy_from_user(void* dst, const void* src, size_t size) {
+    if (!access_ok(src, size) || x86_copy_user(dst, src, size) != 0) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+// get_user reads a single value from user pointer ptr into lvalue x. Returns 0 or -EFAULT.
+#define get_user(x, ptr) copy_from_user(&(x), (ptr), sizeof(*(ptr)))
+
+// put_user writes value x to user pointer ptr. Returns 0 or -EFAULT.
+#define put_user(x, ptr) copy_to_user((ptr), &(__typeof__(*(ptr))){ (x) }, sizeof(*(ptr)))
@@ -7,3 +7,5 @@ extern int _phys_end_kernel_sections;
 extern int _phys_start_user;
 extern int _phys_end_user;
 extern int _phys_start_hh;
+extern int _ex_table_start;
+extern int _ex_table_end;
@@ -1,10 +1,13 @@
 #include <stdbool.h>
 #include "frame_alloc.h"
+#include "kernel/errno.h"
 #include "kernel/multiboot.h"
 #include "kernel/panic.h"
+#include "mm/obj.h"
 #include "defs.h"
 #include "paging.h"
 #include "linker.h"
+#include "arch/x86/arch.h"
 
 
 /**
@@ -14,16 +17,47 @@
  */
 
 
-#define MAX_ALLOC_LEVEL 11
+// Blocks of up to 2^(MAX_ALLOC_LEVEL - 1) pages (1 GiB) can be allocated.
+#define MAX_ALLOC_LEVEL 19
+static_assert((1ull << (MAX_ALLOC_LEVEL - 1)) == FRAMES_ALLOC_MAX, "Bad max level");
 
-#if 0
-typedef struct frame {
-    struct frame* next;
-} __attribute__((aligned(PAGE_SIZE))) frame_t;
-#endif
+// Each chunk manages a naturally aligned window of physical memory, which fits a single block of the highest level.
+#define CHUNK_PAGES (1ull << (MAX_ALLOC_LEVEL - 1))
+#define CHUNK_SIZE  (CHUNK_PAGES * PAGE_SIZE)
+
+// Size of the buddy pairs bitmap of a single chunk.
+#define CHUNK_DATA_SIZE ((1 << MAX_ALLOC_LEVEL) / 16)
+
+// Kernel sections, multiboot info and the allocator's own metadata.
+#define MAX_PRESERVED_AREAS 16
+
+// Parts of RAM regions left after subtracting preserved areas.
+#define MAX_USABLE_RANGES 64
+
+/**
+ * Only the first DEFERRED_INIT_SYNC_PAGES of usable RAM are added to the buddy allocator at boot.
+ * The rest is added DEFERRED_INIT_STEP_PAGES at a time when the CPU is idle or an allocation
+ * can't be satisfied otherwise.
+ */
+#define DEFERRED_INIT_SYNC_PAGES (256 * MB / PAGE_SIZE)
+#define DEFERRED_INIT_STEP_PAGES (32 * MB / PAGE_SIZE)
 
-static bool intersects(void *frame, mem_region_t area) {
-    return area.start <= frame && frame < area.end;
+/**
+ * Single frames are served from per-CPU caches, which are refilled from and drained
+ * to the buddy lists PCP_BATCH frames at a time.
+ */
+#define PCP_BATCH 32
+#define PCP_HIGH  (4 * PCP_BATCH)
+
+/**
+ * Pool of frames zeroed in advance by frame_zero_pool_refill, which serves FRAME_ZERO
+ * allocations without zeroing on the hot path.
+ */
+#define ZERO_POOL_SIZE  256
+#define ZERO_POOL_BATCH 16
+
+static void zero_frames(void *addr, size_t n) {
+    x86_stosq(addr, 0, n * PAGE_SIZE / sizeof(uint64_t));
 }
 
 struct list_node {
@@ -34,23 +68,48 @@ struct list_node {
 struct buddy_alloc_chunk {
     mem_region_t mem;
     struct list_node level_lists[MAX_ALLOC_LEVEL];
+    // Bit i is set iff level_lists[i] is non-empty.
+    uint32_t levels_mask;
     /**
      * For each pair of buddies, we use a single parity bit of their combined freedom
-     * (0 if same, 1 if opposite)
+     * (0 if same, 1 if opposite). CHUNK_DATA_SIZE bytes, allocated only for chunks that contain RAM.
      */
-    unsigned char data[(1 << MAX_ALLOC_LEVEL) / 16];
+    unsigned char *data;
 };
 
 static size_t preserved_areas_size = 0;
-static mem_region_t preserved_areas[128] = {};
+static mem_region_t preserved_areas[MAX_PRESERVED_AREAS] = {};
 
+// Chunk i covers physical memory [i * CHUNK_SIZE, (i + 1) * CHUNK_SIZE). Sized at boot.
 static size_t used_areas_size = 0;
-static struct buddy_alloc_chunk used_areas[512] = {};
+static struct buddy_alloc_chunk *used_areas = NULL;
+
+/**
+ * For each level, a bitmap of chunks that have free blocks at that level, and the number of such chunks.
+ * Together with levels_mask they let the allocator find the smallest suitable block with a couple of
+ * bit scans instead of probing lists of every chunk.
+ */
+static size_t level_chunks_words = 0;
+static uint64_t *level_chunks[MAX_ALLOC_LEVEL] = {};
+static size_t level_chunks_count[MAX_ALLOC_LEVEL] = {};
+// Bit i is set iff some chunk has a free block at level i.
+static uint32_t levels_mask = 0;
+
+frame_t *mem_map = NULL;
+size_t mem_map_size = 0;
+
+// Sorted by address. usable_ranges[deferred_first...] haven't been added to the buddy allocator yet.
+static size_t usable_ranges_size = 0;
+static mem_region_t usable_ranges[MAX_USABLE_RANGES] = {};
+static size_t deferred_first = 0;
+static uint64_t total_pages = 0;
 
 // mark_preserved_area marks memory area as allocated, all its frames are not touched by frame allocator.
 static void mark_preserved_area(mem_region_t area) {
+    area.start = (void*)ALIGN_DOWN(area.start, PAGE_SIZE);
     area.end = (void*)ALIGN_UP(area.end, PAGE_SIZE);
     printk("preserved area: %p-%p\n", area.start, area.end);
+    BUG_ON(preserved_areas_size >= MAX_PRESERVED_AREAS);
     preserved_areas[preserved_areas_size++] = area;
 }
 
@@ -60,43 +119,163 @@ void mark_preserved_areas() {
     mark_preserved_area(multiboot_mem_region());
 }
 
-// intersects_with_kernel_sections checks if a frame at the given virtual address intersects with kernel sections.
-static bool is_allocated(void* frame) {
-    for (size_t i = 0; i < preserved_areas_size; i++) {
-        if (intersects(frame, preserved_areas[i])) {
-            return true;
+// boot_reserve takes size bytes of usable RAM, which don't intersect any preserved area, and marks them as preserved.
+// Used for allocator's own metadata, so it must be called before RAM is added to the buddy allocator.
+static void *boot_reserve(size_t size) {
+    size = ALIGN_UP(size, PAGE_SIZE);
+
+    struct multiboot_mmap_iter mmap_it;
+    multiboot_mmap_iter_init(&mmap_it);
+    struct multiboot_mmap_entry *mmap_entry;
+    while ((mmap_entry = multiboot_mmap_iter_next(&mmap_it)) != NULL) {
+        if (mmap_entry->type != MULTIBOOT_MMAP_TYPE_RAM) {
+            continue;
+        }
+
+        void *start = PHYS_TO_VIRT(ALIGN_UP(mmap_entry->base_addr, PAGE_SIZE));
+        void *end   = PHYS_TO_VIRT(ALIGN_DOWN(mmap_entry->base_addr + mmap_entry->length, PAGE_SIZE));
+
+        bool moved = true;
+        while (moved && start + size <= end) {
+            moved = false;
+
+            for (size_t i = 0; i < preserved_areas_size; i++) {
+                if (preserved_areas[i].start < start + size && start < preserved_areas[i].end) {
+                    start = preserved_areas[i].end;
+                    moved = true;
+                }
+            }
+        }
+
+        if (start + size <= end) {
+            mark_preserved_area((mem_region_t){start, start + size});
+            return start;
         }
     }
-    return false;
+
+    panic("cannot reserve %U bytes for frame allocator metadata", (uint64_t)size);
 }
 
-static inline bool bac_get(const struct buddy_alloc_chunk *chunk, size_t idx) {
-    BUG_ON_NULL(chunk);
-    BUG_ON(idx >= (sizeof(chunk->data) << 3));
-    
-    unsigned char byte = chunk->data[idx >> 3];
-    return (byte >> (idx & 0b111)) & 0b1;
+// mem_map_init allocates descriptors for all frames up to the end of the last RAM region.
+static void mem_map_init() {
+    struct multiboot_mmap_iter mmap_it;
+    multiboot_mmap_iter_init(&mmap_it);
+    struct multiboot_mmap_entry *mmap_entry;
+    while ((mmap_entry = multiboot_mmap_iter_next(&mmap_it)) != NULL) {
+        if (mmap_entry->type != MULTIBOOT_MMAP_TYPE_RAM) {
+            continue;
+        }
+
+        const size_t end_pfn = DIV_ROUNDUP(mmap_entry->base_addr + mmap_entry->length, PAGE_SIZE);
+        if (end_pfn > mem_map_size) {
+            mem_map_size = end_pfn;
+        }
+    }
+
+    // Descriptors are cleared later, see mem_map_clear.
+    mem_map = boot_reserve(mem_map_size * sizeof(frame_t));
 }
 
-static inline void bac_set(struct buddy_alloc_chunk *chunk, size_t idx, bool value) {
-    BUG_ON_NULL(chunk);
-    BUG_ON(idx >= (sizeof(chunk->data) << 3));
-    
-    unsigned char *byte_ptr = &chunk->data[idx >> 3];
-    unsigned char byte = *byte_ptr;
+// mem_map_clear zeroes descriptors of frames in the given range.
+static void mem_map_clear(const void *start, const void *end) {
+    const uint64_t first_pfn = (uint64_t)VIRT_TO_PHYS(start) / PAGE_SIZE;
+    const uint64_t end_pfn = (uint64_t)VIRT_TO_PHYS(end) / PAGE_SIZE;
+    BUG_ON(first_pfn > end_pfn || end_pfn > mem_map_size);
 
-    if (value) {
-        byte |=  (1 << (idx & 0b111));
-    } else {
-        byte &= ~(1 << (idx & 0b111));
+    x86_stosq(&mem_map[first_pfn], 0, (end_pfn - first_pfn) * sizeof(frame_t) / sizeof(uint64_t));
+}
+
+// sort_regions sorts regions by start address.
+static void sort_regions(mem_region_t *regions, size_t size) {
+    for (size_t i = 1; i < size; i++) {
+        mem_region_t region = regions[i];
+
+        size_t j = i;
+        for (; j > 0 && regions[j - 1].start > region.start; j--) {
+            regions[j] = regions[j - 1];
+        }
+        regions[j] = region;
     }
+}
 
-    *byte_ptr = byte;
+// add_usable_range appends a non-empty range to usable_ranges.
+static void add_usable_range(void *start, void *end) {
+    if (start >= end) {
+        return;
+    }
+
+    BUG_ON(usable_ranges_size >= MAX_USABLE_RANGES);
+    usable_ranges[usable_ranges_size++] = (mem_region_t){start, end};
+}
+
+// usable_ranges_init subtracts preserved areas from RAM regions and decides which part of the result is added at boot.
+static void usable_ranges_init() {
+    sort_regions(preserved_areas, preserved_areas_size);
+
+    struct multiboot_mmap_iter mmap_it;
+    multiboot_mmap_iter_init(&mmap_it);
+    struct multiboot_mmap_entry *mmap_entry;
+    while ((mmap_entry = multiboot_mmap_iter_next(&mmap_it)) != NULL) {
+        if (mmap_entry->type != MULTIBOOT_MMAP_TYPE_RAM) {
+            continue;
+        }
+
+        void *start = PHYS_TO_VIRT(ALIGN_UP(mmap_entry->base_addr, PAGE_SIZE));
+        void *end   = PHYS_TO_VIRT(ALIGN_DOWN(mmap_entry->base_addr + mmap_entry->length, PAGE_SIZE));
+
+        for (size_t i = 0; i < preserved_areas_size && start < end; i++) {
+            const mem_region_t area = preserved_areas[i];
+            if (area.end <= start) {
+                continue;
+            }
+            if (area.start >= end) {
+                break;
+            }
+
+            add_usable_range(start, area.start);
+            start = area.end;
+        }
+
+        add_usable_range(start, end);
+    }
+
+    sort_regions(usable_ranges, usable_ranges_size);
+
+    // Find the boundary of the synchronously added part, splitting the range it falls into.
+    size_t pages = 0;
+    for (deferred_first = 0; deferred_first < usable_ranges_size; deferred_first++) {
+        mem_region_t *range = &usable_ranges[deferred_first];
+        const size_t range_pages = (range->end - range->start) / PAGE_SIZE;
+
+        if (pages + range_pages > DEFERRED_INIT_SYNC_PAGES) {
+            void *boundary = range->start + (DEFERRED_INIT_SYNC_PAGES - pages) * PAGE_SIZE;
+            if (boundary > range->start) {
+                void *end = range->end;
+                range->end = boundary;
+                deferred_first++;
+                add_usable_range(boundary, end);
+                sort_regions(usable_ranges, usable_ranges_size);
+            }
+            break;
+        }
+
+        pages += range_pages;
+    }
+}
+
+static inline bool bac_get(const struct buddy_alloc_chunk *chunk, size_t idx) {
+    BUG_ON_NULL(chunk);
+    BUG_ON_NULL(chunk->data);
+    BUG_ON(idx >= (CHUNK_DATA_SIZE << 3));
+    
+    unsigned char byte = chunk->data[idx >> 3];
+    return (byte >> (idx & 0b111)) & 0b1;
 }
 
 static inline void bac_flip(struct buddy_alloc_chunk *chunk, size_t idx) {
     BUG_ON_NULL(chunk);
-    BUG_ON(idx >= (sizeof(chunk->data) << 3));
+    BUG_ON_NULL(chunk->data);
+    BUG_ON(idx >= (CHUNK_DATA_SIZE << 3));
     
     unsigned char *byte_ptr = &chunk->data[idx >> 3];
     unsigned char byte = *byte_ptr;
@@ -109,8 +288,10 @@ static inline void bac_flip(struct buddy_alloc_chunk *chunk, size_t idx) {
 static inline unsigned bac_row_to_table_idx(unsigned level, unsigned row_idx) {
     BUG_ON(level >= MAX_ALLOC_LEVEL);
 
-    // TODO: May be wrong, check!
-    return ((1 << (MAX_ALLOC_LEVEL - level - 1)) + row_idx - 1) >> 1;
+    // Nodes are numbered like in a binary heap, starting from the top-level block as 1,
+    // so both buddies of a pair map to their parent's number. Bit 0 belongs to the
+    // top-level block, which has no buddy.
+    return ((1u << (MAX_ALLOC_LEVEL - level - 1)) + row_idx) >> 1;
 }
 
 static inline unsigned bac_get_row_idx(const struct buddy_alloc_chunk *chunk, unsigned level, const void *addr) {
@@ -133,16 +314,94 @@ static inline unsigned bac_get_buddypair_idx(const struct buddy_alloc_chunk *chu
     return bac_row_to_table_idx(level, bac_get_buddypair_row_idx(chunk, level, addr));
 }
 
-static void bac_init(struct buddy_alloc_chunk *chunk) {
+static void bac_init(struct buddy_alloc_chunk *chunk, void *start) {
     BUG_ON_NULL(chunk);
 
+    chunk->mem = (mem_region_t){start, start + CHUNK_SIZE};
+    chunk->levels_mask = 0;
+    chunk->data = NULL;
+
     for (unsigned level = 0; level < MAX_ALLOC_LEVEL; ++level) {
         struct list_node *head = &chunk->level_lists[level];
 
         head->prev = head->next = head;
     }
+}
+
+static bool chunk_has_ram(size_t idx) {
+    const uint64_t start = idx * CHUNK_SIZE;
+    const uint64_t end = start + CHUNK_SIZE;
 
-    memset(chunk->data, 0, sizeof(chunk->data));
+    struct multiboot_mmap_iter mmap_it;
+    multiboot_mmap_iter_init(&mmap_it);
+    struct multiboot_mmap_entry *mmap_entry;
+    while ((mmap_entry = multiboot_mmap_iter_next(&mmap_it)) != NULL) {
+        if (mmap_entry->type == MULTIBOOT_MMAP_TYPE_RAM &&
+            mmap_entry->base_addr < end && start < mmap_entry->base_addr + mmap_entry->length) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// chunks_init allocates buddy allocator metadata for all chunks covered by mem_map.
+static void chunks_init() {
+    used_areas_size = DIV_ROUNDUP(mem_map_size, CHUNK_PAGES);
+    used_areas = boot_reserve(used_areas_size * sizeof(struct buddy_alloc_chunk));
+
+    size_t ram_chunks = 0;
+    for (size_t i = 0; i < used_areas_size; i++) {
+        ram_chunks += chunk_has_ram(i);
+    }
+
+    unsigned char *data = boot_reserve(ram_chunks * CHUNK_DATA_SIZE);
+    zero_frames(data, DIV_ROUNDUP(ram_chunks * CHUNK_DATA_SIZE, PAGE_SIZE));
+
+    level_chunks_words = DIV_ROUNDUP(used_areas_size, 64);
+    uint64_t *level_chunks_data = boot_reserve(MAX_ALLOC_LEVEL * level_chunks_words * sizeof(uint64_t));
+    zero_frames(level_chunks_data, DIV_ROUNDUP(MAX_ALLOC_LEVEL * level_chunks_words * sizeof(uint64_t), PAGE_SIZE));
+    for (unsigned level = 0; level < MAX_ALLOC_LEVEL; level++) {
+        level_chunks[level] = level_chunks_data + level * level_chunks_words;
+    }
+
+    for (size_t i = 0; i < used_areas_size; i++) {
+        bac_init(&used_areas[i], PHYS_TO_VIRT(i * CHUNK_SIZE));
+
+        if (chunk_has_ram(i)) {
+            used_areas[i].data = data;
+            data += CHUNK_DATA_SIZE;
+        }
+    }
+}
+
+static inline struct buddy_alloc_chunk *bac_chunk_of(const void *addr) {
+    const size_t idx = (uint64_t)VIRT_TO_PHYS(addr) / CHUNK_SIZE;
+    BUG_ON(idx >= used_areas_size);
+
+    return &used_areas[idx];
+}
+
+// bac_level_filled is called when a chunk's list at the given level becomes non-empty.
+static void bac_level_filled(struct buddy_alloc_chunk *chunk, unsigned level) {
+    const size_t idx = chunk - used_areas;
+
+    chunk->levels_mask |= 1u << level;
+    level_chunks[level][idx / 64] |= 1ull << (idx % 64);
+    if (level_chunks_count[level]++ == 0) {
+        levels_mask |= 1u << level;
+    }
+}
+
+// bac_level_emptied is called when a chunk's list at the given level becomes empty.
+static void bac_level_emptied(struct buddy_alloc_chunk *chunk, unsigned level) {
+    const size_t idx = chunk - used_areas;
+
+    chunk->levels_mask &= ~(1u << level);
+    level_chunks[level][idx / 64] &= ~(1ull << (idx % 64));
+    if (--level_chunks_count[level] == 0) {
+        levels_mask &= ~(1u << level);
+    }
 }
 
 static void bac_add_node(struct buddy_alloc_chunk *chunk, unsigned level, struct list_node *node) {
@@ -151,12 +410,20 @@ static void bac_add_node(struct buddy_alloc_chunk *chunk, unsigned level, struct
 
     struct list_node *head = &chunk->level_lists[level];
 
+    if (head->next == head) {
+        bac_level_filled(chunk, level);
+    }
+
     node->prev = head;
     node->next = head->next;
 
     head->next->prev = node;
     head->next = node;
 
+    frame_t *frame = frame_from_addr(node);
+    frame->order = level;
+    frame->flags |= FRAME_STATE_BUDDY;
+
     bac_flip(chunk, bac_get_buddypair_idx(chunk, level, node));
 }
 
@@ -167,49 +434,17 @@ static void bac_rem_node(struct buddy_alloc_chunk *chunk, unsigned level, struct
     node->prev->next = node->next;
     node->next->prev = node->prev;
 
-    bac_flip(chunk, bac_get_buddypair_idx(chunk, level, node));
-}
-
-// TODO: Some sort of bac_dump?
-
-static void bac_add_region(mem_region_t region) {
-    BUG_ON_NULL(region.start);
-    BUG_ON_NULL(region.end);
-
-    BUG_ON((size_t)region.start % PAGE_SIZE != 0);
-    BUG_ON((size_t)region.end   % PAGE_SIZE != 0);
-
-    size_t size = (region.end - region.start) / PAGE_SIZE;
-
-    const size_t max_tile_size = (1 << (MAX_ALLOC_LEVEL - 1));
-    while (size > max_tile_size) {
-        bac_add_region((mem_region_t){region.start, region.start + max_tile_size * PAGE_SIZE});
-        region.start += max_tile_size * PAGE_SIZE;
-        size -= max_tile_size;
+    if (chunk->level_lists[level].next == &chunk->level_lists[level]) {
+        bac_level_emptied(chunk, level);
     }
 
-    BUG_ON((used_areas_size + 1) * sizeof(used_areas[0]) >= sizeof(used_areas));
-    struct buddy_alloc_chunk *chunk = &used_areas[used_areas_size++];
-    chunk->mem = region;
-
-    bac_init(chunk);
-
-    for (unsigned level = MAX_ALLOC_LEVEL - 1;
-         size > 0 && level != -1u;
-         --level) {
-        
-        const size_t level_size = 1 << level;
-        if (level_size > size) {
-            continue;
-        }
-
-        bac_add_node(chunk, level, region.start);
+    frame_from_addr(node)->flags &= ~FRAME_STATE_BUDDY;
 
-        region.start += level_size * PAGE_SIZE;
-        size -= level_size;
-    }
+    bac_flip(chunk, bac_get_buddypair_idx(chunk, level, node));
 }
 
+// TODO: Some sort of bac_dump?
+
 static struct list_node *bac_split(struct buddy_alloc_chunk *chunk, unsigned level, struct list_node *node) {
     BUG_ON_NULL(chunk);
     BUG_ON(level == 0);
@@ -220,15 +455,14 @@ static struct list_node *bac_split(struct buddy_alloc_chunk *chunk, unsigned lev
     bac_add_node(chunk, level - 1, node);
     bac_add_node(chunk, level - 1, right_half_node);
 
-    bac_set(chunk, bac_get_buddypair_idx(chunk, level - 1, node), false);
-
     return node;
 }
 
 static void bac_merge(struct buddy_alloc_chunk *chunk, unsigned level, struct list_node *node) {
     BUG_ON_NULL(chunk);
     
-    if (level >= MAX_ALLOC_LEVEL) {
+    if (level + 1 >= MAX_ALLOC_LEVEL) {
+        // Top-level blocks have no buddies
         return;
     }
 
@@ -254,10 +488,6 @@ static void bac_merge(struct buddy_alloc_chunk *chunk, unsigned level, struct li
     bac_add_node(chunk, level + 1, node);
 
     bac_merge(chunk, level + 1, node);
-
-    // Just in case
-    // TODO: Maybe remove or move up, before the recursive merge?
-    bac_set(chunk, bac_get_buddypair_idx(chunk, level, node), false);
 }
 
 // May return null on failure
@@ -268,37 +498,74 @@ static struct list_node *bac_get_node(struct buddy_alloc_chunk *chunk, unsigned
         return NULL;
     }
 
-    struct list_node *node = &chunk->level_lists[level];
+    // The smallest non-empty level that is large enough.
+    const uint32_t suitable = chunk->levels_mask & ~((1u << level) - 1);
+    if (!suitable) {
+        return NULL;
+    }
+
+    unsigned found = __builtin_ctz(suitable);
+    struct list_node *node = chunk->level_lists[found].next;
 
-    if (node->next != node) {
-        return node->next;
+    for (; found > level; --found) {
+        node = bac_split(chunk, found, node);
     }
 
-    node = bac_get_node(chunk, level + 1);
-    if (!node) {
-        return node;
+    return node;
+}
+
+// bac_level_for returns the lowest level, which blocks hold at least the given number of pages.
+static inline unsigned bac_level_for(size_t pages) {
+    unsigned level = 0;
+    while ((1ull << level) < pages) {
+        level++;
     }
+    return level;
+}
+
+// bac_free_range returns pages starting at node to the chunk, splitting them into naturally aligned blocks.
+static void bac_free_range(struct buddy_alloc_chunk *chunk, struct list_node *node, size_t pages) {
+    BUG_ON_NULL(chunk);
+
+    while (pages > 0) {
+        const size_t row = bac_get_row_idx(chunk, 0, node);
+
+        unsigned level = 0;
+        while (level + 1 < MAX_ALLOC_LEVEL &&
+               (row & ((2ull << level) - 1)) == 0 &&
+               (2ull << level) <= pages) {
+            level++;
+        }
 
-    return bac_split(chunk, level + 1, node);
+        BUG_ON(frame_from_addr(node)->flags & FRAME_STATE_BUDDY);
+
+        bac_add_node(chunk, level, node);
+        bac_merge(chunk, level, node);
+
+        node = ((void *)node) + (PAGE_SIZE << level);
+        pages -= 1ull << level;
+    }
 }
 
 static struct list_node *bac_alloc_pages(struct buddy_alloc_chunk *chunk, size_t pages) {
     BUG_ON_NULL(chunk);
-    // BUG_ON(pages > (1 << (MAX_ALLOC_LEVEL - 1)));
-    // BUG_ON(pages == 0);
 
-    if (pages == 0) {
+    if (pages == 0 || pages > CHUNK_PAGES) {
         return NULL;
     }
 
-    unsigned level = MAX_ALLOC_LEVEL - 1;
-    for (size_t cur_pages = 1 << level; 
-         cur_pages > pages; 
-         cur_pages >>= 1, --level) {}
+    const unsigned level = bac_level_for(pages);
     
     struct list_node *node = bac_get_node(chunk, level);
-    if (node) {
-        bac_rem_node(chunk, level, node);
+    if (!node) {
+        return NULL;
+    }
+
+    bac_rem_node(chunk, level, node);
+
+    // Return the unused tail of the block.
+    if ((1ull << level) > pages) {
+        bac_free_range(chunk, ((void *)node) + pages * PAGE_SIZE, (1ull << level) - pages);
     }
 
     return node;
@@ -306,91 +573,425 @@ static struct list_node *bac_alloc_pages(struct buddy_alloc_chunk *chunk, size_t
 
 static void bac_free_pages(struct buddy_alloc_chunk *chunk, struct list_node *node, size_t pages) {
     BUG_ON_NULL(chunk);
-    // BUG_ON(pages > (1 << (MAX_ALLOC_LEVEL - 1)));
-    // BUG_ON(pages == 0);
+    BUG_ON(pages > CHUNK_PAGES);
 
-    if (pages == 0) {
-        return;
-    }
+    bac_free_range(chunk, node, pages);
+}
 
-    unsigned level = MAX_ALLOC_LEVEL - 1;
-    for (size_t cur_pages = 1 << level; 
-         cur_pages > pages; 
-         cur_pages >>= 1, --level) {}
+// bac_add_region adds a region of free RAM to the chunks it spans.
+static void bac_add_region(mem_region_t region) {
+    BUG_ON_NULL(region.start);
+    BUG_ON_NULL(region.end);
 
-    bac_add_node(chunk, level, node);
-    
-    bac_merge(chunk, level, node);
+    BUG_ON((size_t)region.start % PAGE_SIZE != 0);
+    BUG_ON((size_t)region.end   % PAGE_SIZE != 0);
+
+    while (region.start < region.end) {
+        struct buddy_alloc_chunk *chunk = bac_chunk_of(region.start);
+        void *end = region.end < chunk->mem.end ? region.end : chunk->mem.end;
+
+        for (void *frame = region.start; frame < end; frame += PAGE_SIZE) {
+            frame_from_addr(frame)->chunk = chunk;
+        }
+
+        bac_free_range(chunk, region.start, (end - region.start) / PAGE_SIZE);
+
+        region.start = end;
+    }
 }
 
-// allocated_memory_region adds a region of RAM to the buddy allocator.
-static size_t frame_alloc_add_area(void *base, size_t sz) {
-    size_t pgcnt = 0;
-    void *prev_free = NULL;
+// deferred_init_step adds the next piece of deferred RAM to the buddy allocator. Returns false if there is none left.
+// Must be called with interrupts disabled.
+static bool deferred_init_step() {
+    if (deferred_first >= usable_ranges_size) {
+        return false;
+    }
 
-    // TODO: Was "i < sz-1". Why?
-    for (size_t i = 0; i < sz; i++) {
-        void *curr = base + i * PAGE_SIZE;
+    mem_region_t *range = &usable_ranges[deferred_first];
+    void *end = range->start + DEFERRED_INIT_STEP_PAGES * PAGE_SIZE;
+    if (end > range->end) {
+        end = range->end;
+    }
 
-        if (is_allocated(curr)) {
-            if (prev_free) {
-                bac_add_region((mem_region_t){prev_free, curr});
-                prev_free = NULL;
-            }
+    mem_map_clear(range->start, end);
+    bac_add_region((mem_region_t){range->start, end});
+    total_pages += (end - range->start) / PAGE_SIZE;
 
-            continue;
+    range->start = end;
+    if (range->start == range->end) {
+        deferred_first++;
+
+        if (deferred_first == usable_ranges_size) {
+            printk("frame allocator: deferred init done, %U pages total\n", total_pages);
         }
+    }
+
+    return true;
+}
 
-        if (!prev_free) {
-            prev_free = curr;
+// buddy_alloc takes n pages from the chunk, which has the smallest free block that fits them.
+static void *buddy_alloc(size_t n) {
+    if (n == 0 || n > CHUNK_PAGES) {
+        return NULL;
+    }
+
+    const uint32_t suitable = levels_mask & ~((1u << bac_level_for(n)) - 1);
+    if (!suitable) {
+        return NULL;
+    }
+
+    const uint64_t *chunks = level_chunks[__builtin_ctz(suitable)];
+    for (size_t word = 0; word < level_chunks_words; word++) {
+        if (chunks[word]) {
+            return bac_alloc_pages(&used_areas[word * 64 + __builtin_ctzll(chunks[word])], n);
         }
-        
-        pgcnt++;
     }
 
-    if (prev_free) {
-        bac_add_region((mem_region_t){prev_free, base + sz * PAGE_SIZE});
+    BUG_ON_REACH();
+}
+
+// buddy_alloc_upto takes the biggest block available of at most n pages and stores its size in *pages, so n single
+// frames cost a single buddy operation unless memory is fragmented. Returns NULL if there are no free frames, even
+// after initializing more RAM.
+static void *buddy_alloc_upto(size_t n, size_t *pages) {
+    if (!levels_mask && !deferred_init_step()) {
+        return NULL;
+    }
+
+    unsigned level = 63 - __builtin_clzll(n);
+    const unsigned top = 31 - __builtin_clz(levels_mask);
+    if (level > top) {
+        level = top;
     }
 
-    return pgcnt;
+    void *block = buddy_alloc(1ull << level);
+    BUG_ON_NULL(block);
+    *pages = 1ull << level;
+    return block;
 }
 
-// frame_alloc_add_areas obtains memory areas of usable RAM from Multiboot2 and adds them to the frame allocator.
-static void frame_alloc_add_areas() {
-    struct multiboot_mmap_iter mmap_it;
-    multiboot_mmap_iter_init(&mmap_it);
-    struct multiboot_mmap_entry* mmap_entry;
-    size_t pgcnt = 0;
-    while ((mmap_entry = multiboot_mmap_iter_next(&mmap_it)) != NULL) {
-        if (mmap_entry->type != MULTIBOOT_MMAP_TYPE_RAM) {
-            continue;
+static void buddy_free(void *addr, size_t n) {
+    frame_t *frame = frame_from_addr(addr);
+    if (!frame || !frame->chunk) {
+        panic("Free called on non-allocated memory");
+    }
+
+    bac_free_pages(frame->chunk, addr, n);
+}
+
+// Per-CPU frame cache. Recently freed (hot) frames are kept at the head of the list,
+// frames fresh from the buddy allocator are appended to the cold tail, and drains take
+// frames from the tail as well, so the hot ones stay cached.
+struct frame_pcp {
+    struct list_node frames;
+    size_t count;
+    frame_pcp_stats_t stats;
+};
+
+static struct frame_pcp pcps[MAX_CPUS] = {};
+
+static struct frame_pcp *pcp_current() {
+    struct frame_pcp *pcp = &pcps[arch_cpu_id()];
+
+    if (!pcp->frames.next) {
+        pcp->frames.prev = pcp->frames.next = &pcp->frames;
+    }
+
+    return pcp;
+}
+
+static void pcp_push_head(struct frame_pcp *pcp, struct list_node *node) {
+    node->prev = &pcp->frames;
+    node->next = pcp->frames.next;
+    pcp->frames.next->prev = node;
+    pcp->frames.next = node;
+    pcp->count++;
+}
+
+static void pcp_push_tail(struct frame_pcp *pcp, struct list_node *node) {
+    node->next = &pcp->frames;
+    node->prev = pcp->frames.prev;
+    pcp->frames.prev->next = node;
+    pcp->frames.prev = node;
+    pcp->count++;
+}
+
+static struct list_node *pcp_pop(struct frame_pcp *pcp, bool hot) {
+    BUG_ON(pcp->count == 0);
+
+    struct list_node *node = hot ? pcp->frames.next : pcp->frames.prev;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    pcp->count--;
+
+    return node;
+}
+
+// pcp_refill moves up to PCP_BATCH single frames from the buddy lists to the cache. They are taken as a single block
+// and split, smaller blocks are only used if memory is fragmented.
+static void pcp_refill(struct frame_pcp *pcp) {
+    size_t got = 0;
+
+    while (got < PCP_BATCH) {
+        size_t pages = 0;
+        void *block = buddy_alloc_upto(PCP_BATCH - got, &pages);
+        if (!block) {
+            break;
         }
-        pgcnt += frame_alloc_add_area(PHYS_TO_VIRT(mmap_entry->base_addr), mmap_entry->length / PAGE_SIZE);
+
+        for (size_t i = 0; i < pages; i++) {
+            pcp_push_tail(pcp, block + i * PAGE_SIZE);
+        }
+        got += pages;
     }
-    printk("initialized page_alloc with %d pages\n", pgcnt);
+
+    pcp->stats.refills++;
+    pcp->stats.refilled += got;
+}
+
+// pcp_drain returns up to cnt of the coldest cached frames back to the buddy lists.
+static void pcp_drain(struct frame_pcp *pcp, size_t cnt) {
+    size_t released = 0;
+
+    while (pcp->count > 0 && released < cnt) {
+        buddy_free(pcp_pop(pcp, false), 1);
+        released++;
+    }
+
+    pcp->stats.drains++;
+    pcp->stats.drained += released;
+}
+
+bool frame_alloc_deferred_init() {
+    uint64_t irq = irq_save();
+    bool added = deferred_init_step();
+    irq_restore(irq);
+
+    return added;
 }
 
 void frame_alloc_init() {
     mark_preserved_areas();
-    frame_alloc_add_areas();
+    mem_map_init();
+    chunks_init();
+    usable_ranges_init();
+
+    // Descriptors of deferred ranges are cleared right before they are added.
+    void *cleared = PHYS_TO_VIRT(0);
+    for (size_t i = deferred_first; i < usable_ranges_size; i++) {
+        mem_map_clear(cleared, usable_ranges[i].start);
+        cleared = usable_ranges[i].end;
+    }
+    mem_map_clear(cleared, PHYS_TO_VIRT(mem_map_size * PAGE_SIZE));
+
+    for (size_t i = 0; i < deferred_first; i++) {
+        bac_add_region(usable_ranges[i]);
+        total_pages += (usable_ranges[i].end - usable_ranges[i].start) / PAGE_SIZE;
+    }
+
+    printk("initialized page_alloc with %U pages, %U ranges deferred\n",
+           total_pages, (uint64_t)(usable_ranges_size - deferred_first));
 
     // TODO: Dump buddy state?
 }
 
-void *frames_alloc(size_t n) {
-    for (struct buddy_alloc_chunk *chunk = used_areas;
-         chunk < used_areas + used_areas_size;
-         ++chunk) {
-        
-        void *result = bac_alloc_pages(chunk, n);
-        if (result) {
-            // TODO: Maybe remove, or make optional?
-            memset(result, 0, n * PAGE_SIZE);
-            return result;
+// Free frames, which are known to be filled with zeroes. Linked through their first quadword.
+static struct {
+    void *head;
+    size_t count;
+} zero_pool = {};
+
+static void zero_pool_push(void *frame) {
+    *(void **)frame = zero_pool.head;
+    zero_pool.head = frame;
+    zero_pool.count++;
+}
+
+static void *zero_pool_pop() {
+    void *frame = zero_pool.head;
+    if (frame) {
+        zero_pool.head = *(void **)frame;
+        zero_pool.count--;
+        // Restore the only dirty quadword.
+        *(void **)frame = NULL;
+    }
+    return frame;
+}
+
+// zero_pool_drain returns all pre-zeroed frames to the buddy lists, so they can form bigger blocks.
+static void zero_pool_drain() {
+    void *frame = NULL;
+    while ((frame = zero_pool_pop())) {
+        buddy_free(frame, 1);
+    }
+}
+
+void frame_zero_pool_refill() {
+    for (size_t i = 0; i < ZERO_POOL_BATCH; i++) {
+        uint64_t irq = irq_save();
+
+        struct frame_pcp *pcp = pcp_current();
+        if (zero_pool.count < ZERO_POOL_SIZE && pcp->count == 0) {
+            pcp_refill(pcp);
         }
+
+        if (zero_pool.count >= ZERO_POOL_SIZE || pcp->count == 0) {
+            irq_restore(irq);
+            break;
+        }
+        // Take the coldest frame, hot ones are better spent on regular allocations.
+        void *frame = pcp_pop(pcp, false);
+
+        irq_restore(irq);
+
+        zero_frames(frame, 1);
+
+        irq = irq_save();
+        zero_pool_push(frame);
+        irq_restore(irq);
     }
+}
 
-    return NULL;
+// buddy_alloc_slow takes n pages from the buddy lists, trying to initialize more RAM or flush caches if there are none.
+static void *buddy_alloc_slow(size_t n) {
+    uint64_t irq = irq_save();
+
+    void *result = buddy_alloc(n);
+    while (!result && deferred_init_step()) {
+        result = buddy_alloc(n);
+    }
+
+    if (!result) {
+        // Frames sitting in the caches may be exactly what's needed to form a bigger block.
+        struct frame_pcp *pcp = pcp_current();
+        pcp_drain(pcp, pcp->count);
+        zero_pool_drain();
+        result = buddy_alloc(n);
+    }
+
+    irq_restore(irq);
+
+    return result;
+}
+
+void *frames_alloc(size_t n, uint64_t flags) {
+    if (n == 1) {
+        return frame_alloc(flags);
+    }
+
+    void *result = NULL;
+    if (flags & FRAME_NO_RECLAIM) {
+        uint64_t irq = irq_save();
+        result = buddy_alloc(n);
+        irq_restore(irq);
+    } else {
+        result = buddy_alloc_slow(n);
+        if (!result && object_reclaim() > 0) {
+            result = buddy_alloc_slow(n);
+        }
+    }
+
+    if (result) {
+        for (frame_t *frame = frame_from_addr(result); frame < frame_from_addr(result) + n; frame++) {
+            frame->refcount = 1;
+        }
+
+        if (flags & FRAME_ZERO) {
+            zero_frames(result, n);
+        }
+    }
+
+    return result;
+}
+
+// frames_alloc_bulk_once is frames_alloc_bulk without the slab reclaim fallback.
+static int frames_alloc_bulk_once(size_t n, void **frames, uint64_t flags) {
+    size_t got = 0;
+    size_t zeroed = 0;
+
+    uint64_t irq = irq_save();
+
+    if (flags & FRAME_ZERO) {
+        while (got < n && (frames[got] = zero_pool_pop())) {
+            got++;
+        }
+        zeroed = got;
+    }
+
+    struct frame_pcp *pcp = pcp_current();
+    while (got < n && pcp->count > 0) {
+        frames[got++] = pcp_pop(pcp, true);
+        pcp->stats.hits++;
+    }
+
+    // Take the rest as the largest blocks available and split them, instead of going through the buddy lists per frame.
+    while (got < n) {
+        size_t pages = 0;
+        void *block = buddy_alloc_upto(n - got, &pages);
+        if (!block) {
+            break;
+        }
+
+        for (size_t i = 0; i < pages; i++) {
+            frames[got++] = block + i * PAGE_SIZE;
+        }
+    }
+
+    if (!(flags & FRAME_ZERO)) {
+        while (got < n && (frames[got] = zero_pool_pop())) {
+            got++;
+        }
+    }
+
+    if (got < n) {
+        for (size_t i = 0; i < got; i++) {
+            pcp_push_head(pcp, frames[i]);
+        }
+        if (pcp->count > PCP_HIGH) {
+            pcp_drain(pcp, pcp->count - PCP_HIGH);
+        }
+
+        irq_restore(irq);
+        return -ENOMEM;
+    }
+
+    irq_restore(irq);
+
+    for (size_t i = 0; i < n; i++) {
+        frame_from_addr(frames[i])->refcount = 1;
+
+        if ((flags & FRAME_ZERO) && i >= zeroed) {
+            zero_frames(frames[i], 1);
+        }
+    }
+
+    return 0;
+}
+
+int frames_alloc_bulk(size_t n, void **frames, uint64_t flags) {
+    BUG_ON(n > 0 && !frames);
+
+    int err = frames_alloc_bulk_once(n, frames, flags);
+    if (err < 0 && object_reclaim() > 0) {
+        err = frames_alloc_bulk_once(n, frames, flags);
+    }
+
+    return err;
+}
+
+// frames_release_check marks frames as free and panics on double free.
+static void frames_release_check(void *addr, size_t n) {
+    frame_t *frame = frame_from_addr(addr);
+    if (!frame || !frame->chunk) {
+        panic("Free called on non-allocated memory");
+    }
+
+    for (frame_t *end = frame + n; frame < end; frame++) {
+        if (frame->refcount == 0) {
+            panic("double free of frame %p", frame_to_addr(frame));
+        }
+        frame->refcount = 0;
+    }
 }
 
 void frames_free(void *addr, size_t n) {
@@ -398,23 +999,272 @@ void frames_free(void *addr, size_t n) {
         return;
     }
 
-    for (struct buddy_alloc_chunk *chunk = used_areas;
-         chunk < used_areas + used_areas_size;
-         ++chunk) {
-        
-        if (intersects(addr, chunk->mem)) {
-            bac_free_pages(chunk, addr, n);
-            return;
+    if (n == 1) {
+        frame_free(addr);
+        return;
+    }
+
+    frames_release_check(addr, n);
+
+    uint64_t irq = irq_save();
+    buddy_free(addr, n);
+    irq_restore(irq);
+}
+
+// pcp_alloc takes a single frame from the current CPU's cache or the zero pool. Sets zeroed if the frame came from the latter.
+static void *pcp_alloc(uint64_t flags, bool *zeroed) {
+    uint64_t irq = irq_save();
+
+    void *result = NULL;
+
+    if ((flags & FRAME_ZERO) && (result = zero_pool_pop())) {
+        *zeroed = true;
+    } else {
+        struct frame_pcp *pcp = pcp_current();
+        if (pcp->count > 0) {
+            pcp->stats.hits++;
+        } else {
+            pcp->stats.misses++;
+            pcp_refill(pcp);
+        }
+
+        if (pcp->count > 0) {
+            result = pcp_pop(pcp, true);
+        } else if ((result = zero_pool_pop())) {
+            // Out of regular frames, pre-zeroed ones are just as good.
+            *zeroed = true;
         }
     }
 
-    panic("Free called on non-allocated memory");
+    irq_restore(irq);
+
+    return result;
 }
 
-void *frame_alloc() {
-    return frames_alloc(1);
+void *frame_alloc(uint64_t flags) {
+    bool zeroed = false;
+
+    void *result = pcp_alloc(flags, &zeroed);
+    if (!result && !(flags & FRAME_NO_RECLAIM) && object_reclaim() > 0) {
+        result = pcp_alloc(flags, &zeroed);
+    }
+
+    if (result) {
+        frame_from_addr(result)->refcount = 1;
+
+        if ((flags & FRAME_ZERO) && !zeroed) {
+            zero_frames(result, 1);
+        }
+    }
+
+    return result;
+}
+
+// pcp_free puts a frame, which has no users left, to the current CPU's cache.
+static void pcp_free(void *addr) {
+    uint64_t irq = irq_save();
+
+    struct frame_pcp *pcp = pcp_current();
+    pcp_push_head(pcp, addr);
+    pcp->stats.frees++;
+
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+
+    irq_restore(irq);
 }
 
 void frame_free(void *addr) {
-    return frames_free(addr, 1);
+    if (!addr) {
+        return;
+    }
+
+    frames_release_check(addr, 1);
+    pcp_free(addr);
 }
+
+void frame_get(void *addr) {
+    frame_t *frame = frame_from_addr(addr);
+    BUG_ON(!frame || !frame->chunk || frame->refcount == 0);
+
+    __atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void frame_put(void *addr) {
+    frame_t *frame = frame_from_addr(addr);
+    BUG_ON(!frame || !frame->chunk || frame->refcount == 0);
+
+    if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pcp_free(addr);
+    }
+}
+
+void frames_put_bulk(size_t n, void **frames) {
+    BUG_ON(n > 0 && !frames);
+
+    size_t unused = 0;
+    for (size_t i = 0; i < n; i++) {
+        frame_t *frame = frame_from_addr(frames[i]);
+        BUG_ON(!frame || !frame->chunk || frame->refcount == 0);
+
+        if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+            frames[unused++] = frames[i];
+        }
+    }
+
+    if (unused == 0) {
+        return;
+    }
+
+    uint64_t irq = irq_save();
+
+    struct frame_pcp *pcp = pcp_current();
+    for (size_t i = 0; i < unused; i++) {
+        pcp_push_head(pcp, frames[i]);
+    }
+    pcp->stats.frees += unused;
+
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, pcp->count - PCP_HIGH);
+    }
+
+    irq_restore(irq);
+}
+
+void frame_alloc_get_pcp_stats(unsigned cpu, frame_pcp_stats_t *stats) {
+    BUG_ON(cpu >= MAX_CPUS);
+    BUG_ON_NULL(stats);
+
+    uint64_t irq = irq_save();
+    *stats = pcps[cpu].stats;
+    irq_restore(irq);
+}
+
+void frame_alloc_dump_pcp_stats() {
+    for (unsigned cpu = 0; cpu < MAX_CPUS; cpu++) {
+        frame_pcp_stats_t stats;
+        frame_alloc_get_pcp_stats(cpu, &stats);
+
+        const uint64_t allocs = stats.hits + stats.misses;
+        if (allocs == 0 && stats.frees == 0) {
+            continue;
+        }
+
+        printk("pcp[%u]: cached=%U, hits=%U/%U (%U%%), refills=%U (%U frames), drains=%U (%U frames), frees=%U\n",
+               cpu, (uint64_t)pcps[cpu].count, stats.hits, allocs, allocs ? stats.hits * 100 / allocs : 0,
+               stats.refills, stats.refilled, stats.drains, stats.drained, stats.frees);
+    }
+}
+
+#ifdef FRAME_ALLOC_BENCH
+#define FRAME_ALLOC_BENCH_ITERS 100000
+
+// bench_scan_alloc is the lookup buddy_alloc used before the level bitmaps: chunks are tried in address order,
+// probing lists of every level from the requested one up, until one of them has a block.
+static void *bench_scan_alloc(size_t n) {
+    const unsigned level = bac_level_for(n);
+    for (struct buddy_alloc_chunk *chunk = used_areas; chunk < used_areas + used_areas_size; ++chunk) {
+        for (unsigned l = level; l < MAX_ALLOC_LEVEL; l++) {
+            if (chunk->level_lists[l].next != &chunk->level_lists[l]) {
+                return bac_alloc_pages(chunk, n);
+            }
+        }
+    }
+    return NULL;
+}
+
+// bench_splits returns the number of splits, which an allocation of n pages takes, i.e. how far the smallest
+// suitable free block is from the requested level. Freeing the block merges the same number of times.
+static unsigned bench_splits(size_t n) {
+    const unsigned level = bac_level_for(n);
+    const uint32_t suitable = levels_mask & ~((1u << level) - 1);
+    return suitable ? __builtin_ctz(suitable) - level : 0;
+}
+
+// bench_run times FRAME_ALLOC_BENCH_ITERS allocations of n pages by alloc, each freed right away.
+// Returns the average number of cycles per allocation and free.
+static uint64_t bench_run(void *(*alloc)(size_t), size_t n, size_t *failed) {
+    *failed = 0;
+
+    uint64_t irq = irq_save();
+    const uint64_t start = x86_rdtsc();
+
+    for (size_t i = 0; i < FRAME_ALLOC_BENCH_ITERS; i++) {
+        void *block = alloc(n);
+        if (!block) {
+            (*failed)++;
+            continue;
+        }
+        buddy_free(block, n);
+    }
+
+    const uint64_t cycles = (x86_rdtsc() - start) / FRAME_ALLOC_BENCH_ITERS;
+    irq_restore(irq);
+    return cycles;
+}
+
+// bench_keep decides, which frames stay allocated during the benchmark. All chunks but the last are left with
+// single free frames only, which makes the scan probe every level of each of them. The last one gets a free block
+// of every level up to 512 pages in each 4 MiB, so neither lookup has to split anything.
+static bool bench_keep(void *frame, struct buddy_alloc_chunk *last) {
+    const uint64_t pfn = (uint64_t)VIRT_TO_PHYS(frame) / PAGE_SIZE;
+    if (frame_from_addr(frame)->chunk != last) {
+        return pfn % 2;
+    }
+    return pfn % 1024 == 0;
+}
+
+// frame_alloc_bench compares the bitmap lookup of buddy_alloc with the old scan under fragmentation, see bench_keep.
+// Both lookups share the split and merge work, which is reported as the number of splits per allocation.
+void frame_alloc_bench() {
+    void *head = NULL;
+    struct buddy_alloc_chunk *last = used_areas;
+
+    void *frame = NULL;
+    while ((frame = frame_alloc(FRAME_NO_FLAGS))) {
+        *(void **)frame = head;
+        head = frame;
+        if (frame_from_addr(frame)->chunk > last) {
+            last = frame_from_addr(frame)->chunk;
+        }
+    }
+
+    void *kept = NULL;
+    while (head) {
+        void *next = *(void **)head;
+
+        if (bench_keep(head, last)) {
+            *(void **)head = kept;
+            kept = head;
+        } else {
+            frame_free(head);
+        }
+
+        head = next;
+    }
+
+    // Freed frames stay in the per-CPU cache otherwise, out of reach of the buddy lists.
+    uint64_t irq = irq_save();
+    struct frame_pcp *pcp = pcp_current();
+    pcp_drain(pcp, pcp->count);
+    irq_restore(irq);
+
+    for (unsigned level = 1; level < 10; level += 4) {
+        const size_t n = 1ull << level;
+        size_t scan_failed = 0;
+        size_t bitmap_failed = 0;
+        const uint64_t scan = bench_run(bench_scan_alloc, n, &scan_failed);
+        const uint64_t bitmap = bench_run(buddy_alloc, n, &bitmap_failed);
+
+        printk("frame_alloc_bench: %U pages: scan %U cycles, bitmap %U cycles per alloc+free, %u splits, %U/%U failed\n",
+               (uint64_t)n, scan, bitmap, bench_splits(n), (uint64_t)scan_failed, (uint64_t)bitmap_failed);
+    }
+
+    while (kept) {
+        void *next = *(void **)kept;
+        frame_free(kept);
+        kept = next;
+    }
+}
+#endif
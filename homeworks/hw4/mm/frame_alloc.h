@@ -1,12 +1,81 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-// frames_alloc allocates continuous memory region contains at least n pages.
-void* frames_alloc(size_t n);
+#include "paging.h"
+#include "kernel/panic.h"
+
+struct buddy_alloc_chunk;
+
+// Maximal number of pages in a single allocation (1 GiB).
+#define FRAMES_ALLOC_MAX (1ull << 18)
+
+// Allocation flags.
+#define FRAME_NO_FLAGS   0
+// Returned frames are filled with zeroes.
+#define FRAME_ZERO       (1 << 0)
+// Only free blocks are tried: no caches are drained and no slabs reclaimed. For opportunistic allocations,
+// which have a cheaper fallback.
+#define FRAME_NO_RECLAIM (1 << 1)
+
+// Frame is free and heads a block in one of the buddy lists, order holds the block's order.
+#define FRAME_STATE_BUDDY (1 << 0)
+// Frame heads a block allocated by kmalloc, pgcnt holds the block's size in pages.
+#define FRAME_STATE_KMALLOC (1 << 1)
+// Frame belongs to an object cache slab, private points to the slab header.
+#define FRAME_STATE_SLAB (1 << 2)
+
+// frame_t describes a single physical frame. Descriptors of all frames are kept in mem_map, indexed by PFN.
+typedef struct frame {
+    // Buddy allocator chunk the frame belongs to, NULL if the frame isn't managed by the frame allocator.
+    struct buddy_alloc_chunk *chunk;
+    // Owner-specific data of an allocated frame, see FRAME_STATE_* flags.
+    union {
+        void *private;
+        size_t pgcnt;
+    };
+    // Number of users of an allocated frame, 0 for free frames.
+    uint32_t refcount;
+    uint8_t order;
+    uint8_t flags;
+    uint16_t reserved;
+} frame_t;
+static_assert(sizeof(frame_t) == 24, "Bad size");
+
+extern frame_t *mem_map;
+extern size_t mem_map_size;
+
+// frame_from_addr returns descriptor of the frame at the given direct mapping address or NULL, if there is no such frame.
+static inline frame_t *frame_from_addr(const void *addr) {
+    const uint64_t pfn = (uint64_t)VIRT_TO_PHYS(addr) / PAGE_SIZE;
+    if (pfn >= mem_map_size) {
+        return NULL;
+    }
+    return &mem_map[pfn];
+}
+
+// frame_to_addr returns direct mapping address of the frame described by frame.
+static inline void *frame_to_addr(const frame_t *frame) {
+    return PHYS_TO_VIRT((uint64_t)(frame - mem_map) * PAGE_SIZE);
+}
+
+// frames_alloc allocates continuous memory region of n pages, up to FRAMES_ALLOC_MAX.
+// The region is aligned to n rounded up to a power of two pages, so e.g. 512 pages form a 2 MiB aligned block.
+void* frames_alloc(size_t n, uint64_t flags);
 
 // frame_alloc allocates single frame.
-void* frame_alloc();
+void* frame_alloc(uint64_t flags);
+
+// frames_alloc_bulk allocates n single frames, not necessarily continuous, and stores their addresses to frames.
+// Either all n frames are allocated and 0 is returned, or none and -ENOMEM is returned.
+// Each frame is released separately with frame_free or frame_put.
+int frames_alloc_bulk(size_t n, void **frames, uint64_t flags);
+
+// frames_put_bulk releases a reference to each of n frames, like frame_put does, and frees the ones left unused
+// in a single pass. The frames array is used as a scratch space and is clobbered.
+void frames_put_bulk(size_t n, void **frames);
 
 // frames_free frees n frames at given base address.
 void frames_free(void* addr, size_t n);
@@ -14,5 +83,43 @@ void frames_free(void* addr, size_t n);
 // frame_free frees frame at given address.
 void frame_free(void* addr);
 
+// frame_get acquires one more reference to an allocated frame.
+void frame_get(void *addr);
+
+// frame_put releases a reference to an allocated frame, the frame is freed once its last reference is gone.
+void frame_put(void *addr);
+
+// frame_zero_pool_refill zeroes a batch of free frames ahead of time, so FRAME_ZERO allocations don't have to.
+// Meant to be called when CPU has nothing better to do, runs with interrupts enabled most of the time.
+void frame_zero_pool_refill();
+
+// frame_alloc_deferred_init adds a piece of RAM, which wasn't initialized at boot, to the frame allocator.
+// Meant to be called when CPU is idle. Returns false when all RAM is already added.
+bool frame_alloc_deferred_init();
+
 // frame_alloc_init initializes frame allocator. Must be called after direct physical memory mapping is created.
 void frame_alloc_init();
+
+#ifdef FRAME_ALLOC_BENCH
+// frame_alloc_bench runs allocator microbenchmark and prints its results. Enabled with KCFLAGS=-DFRAME_ALLOC_BENCH.
+void frame_alloc_bench();
+#endif
+
+// frame_pcp_stats_t holds counters of a per-CPU single frame cache, used for tuning its batch sizes.
+typedef struct frame_pcp_stats {
+    // Allocations served from the cache / which required a refill.
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t frees;
+    // Number of refills and drains and the total number of frames moved by them.
+    uint64_t refills;
+    uint64_t refilled;
+    uint64_t drains;
+    uint64_t drained;
+} frame_pcp_stats_t;
+
+// frame_alloc_get_pcp_stats copies per-CPU cache counters of the given CPU into stats.
+void frame_alloc_get_pcp_stats(unsigned cpu, frame_pcp_stats_t *stats);
+
+// frame_alloc_dump_pcp_stats prints counters of all per-CPU caches that were used.
+void frame_alloc_dump_pcp_stats();
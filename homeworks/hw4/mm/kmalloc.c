@@ -0,0 +1,104 @@
+#include "kmalloc.h"
+#include "frame_alloc.h"
+#include "obj.h"
+#include "common.h"
+#include "kernel/panic.h"
+
+
+/**
+ * Size classes are powers of two with intermediate steps, so the rounding waste stays below a third.
+ * Classes below a cache line are KMALLOC_MIN_ALIGN aligned and share cache lines, the rest are
+ * cache line aligned. Classes from OBJ_OFF_SLAB_MIN_SIZE keep slab headers off-slab, so they pack
+ * multi-page slabs exactly.
+ */
+#define KMALLOC_CACHE(SIZE) OBJ_ALLOC_INIT(SIZE, (SIZE) < CACHE_LINE_SIZE_BYTES ? KMALLOC_MIN_ALIGN : CACHE_LINE_SIZE_BYTES, OBJ_COLOR)
+
+static obj_alloc_t kmalloc_caches[] = {
+    KMALLOC_CACHE(16),
+    KMALLOC_CACHE(32),
+    KMALLOC_CACHE(64),
+    KMALLOC_CACHE(128),
+    KMALLOC_CACHE(192),
+    KMALLOC_CACHE(256),
+    KMALLOC_CACHE(384),
+    KMALLOC_CACHE(512),
+    KMALLOC_CACHE(768),
+    KMALLOC_CACHE(1024),
+    KMALLOC_CACHE(1536),
+    KMALLOC_CACHE(2048),
+    KMALLOC_CACHE(3072),
+    KMALLOC_CACHE(4096),
+    KMALLOC_CACHE(6144),
+    KMALLOC_CACHE(KMALLOC_MAX_CACHE_SIZE),
+};
+
+// kmalloc_cache returns the smallest size class cache, which fits size bytes.
+static obj_alloc_t *kmalloc_cache(size_t size) {
+    for (size_t i = 0; i < ARRAY_SIZE(kmalloc_caches); i++) {
+        if (size <= kmalloc_caches[i].obj_size) {
+            return &kmalloc_caches[i];
+        }
+    }
+
+    BUG_ON_REACH();
+}
+
+void *kmalloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size <= KMALLOC_MAX_CACHE_SIZE) {
+        return object_alloc(kmalloc_cache(size));
+    }
+
+    const size_t pages = DIV_ROUNDUP(size, PAGE_SIZE);
+    if (pages > FRAMES_ALLOC_MAX) {
+        return NULL;
+    }
+
+    // The buddy allocator returns the tail of a bigger block right away, so only the pages asked for are taken.
+    void *ptr = frames_alloc(pages, FRAME_NO_FLAGS);
+    if (!ptr) {
+        return NULL;
+    }
+
+    frame_t *frame = frame_from_addr(ptr);
+    frame->pgcnt = pages;
+    frame->flags |= FRAME_STATE_KMALLOC;
+
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    // Objects of off-slab caches may be page aligned too, so slabs are looked up first.
+    obj_alloc_t *cache = object_alloc_of(ptr);
+    if (cache) {
+        object_free(cache, ptr);
+        return;
+    }
+
+    frame_t *frame = frame_from_addr(ptr);
+    BUG_ON(!frame || !(frame->flags & FRAME_STATE_KMALLOC));
+
+    frame->flags &= ~FRAME_STATE_KMALLOC;
+    frames_free(ptr, frame->pgcnt);
+}
+
+size_t ksize(const void *ptr) {
+    BUG_ON_NULL(ptr);
+
+    obj_alloc_t *cache = object_alloc_of(ptr);
+    if (cache) {
+        return cache->obj_size;
+    }
+
+    const frame_t *frame = frame_from_addr(ptr);
+    BUG_ON(!frame || !(frame->flags & FRAME_STATE_KMALLOC));
+
+    return frame->pgcnt * PAGE_SIZE;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Largest size served from size class caches, bigger allocations take whole frames.
+#define KMALLOC_MAX_CACHE_SIZE 8192
+
+// Minimal alignment of kmalloc allocations.
+#define KMALLOC_MIN_ALIGN 16
+
+// kmalloc allocates size bytes. Small sizes are rounded up to one of the size classes and served from
+// object caches, the rest are rounded up to whole pages and taken from the frame allocator.
+// Returns NULL if there is no memory left.
+void* kmalloc(size_t size);
+
+// kfree frees memory allocated by kmalloc. Size of the allocation is recovered from ptr.
+void kfree(void* ptr);
+
+// ksize returns the number of usable bytes in the allocation at ptr, which may exceed the requested size.
+size_t ksize(const void* ptr);
@@ -0,0 +1,100 @@
+#include "mman.h"
+#include "vmem.h"
+#include "common.h"
+#include "kernel/errno.h"
+#include "kernel/uaccess.h"
+#include "sched/sched.h"
+
+#define PROT_MASK (PROT_READ | PROT_WRITE | PROT_EXEC)
+#define MAP_MASK  (MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_POPULATE)
+
+// prot_to_flags converts PROT_* bits to vmem flags. PROT_NONE pages get no VMEM_USER, so their entries
+// aren't present: both user accesses and uaccess on behalf of the task fault on them and fail.
+static uint64_t prot_to_flags(uint64_t prot) {
+    if (prot == PROT_NONE) {
+        return 0;
+    }
+    return VMEM_USER | ((prot & PROT_WRITE) ? VMEM_WRITE : 0);
+}
+
+// check_range validates a page aligned user range and returns its size in pages, or 0 if it is invalid.
+static size_t check_range(void* addr, uint64_t length) {
+    if ((uint64_t)addr % PAGE_SIZE || (uint64_t)addr < MMAP_MIN_ADDR || length == 0 || length > USER_SPACE_END) {
+        return 0;
+    }
+    const size_t pgcnt = DIV_ROUNDUP(length, PAGE_SIZE);
+    if (!access_ok(addr, pgcnt * PAGE_SIZE)) {
+        return 0;
+    }
+    return pgcnt;
+}
+
+int64_t sys_mmap(arch_regs_t* regs) {
+    void* addr = (void*)syscall_arg0(regs);
+    const uint64_t length = syscall_arg1(regs);
+    const uint64_t prot = syscall_arg2(regs);
+    const uint64_t flags = syscall_arg3(regs);
+
+    if ((prot & ~PROT_MASK) || (flags & ~MAP_MASK) || !(flags & MAP_PRIVATE) || !(flags & MAP_ANONYMOUS)) {
+        return -EINVAL;
+    }
+    if (length == 0 || length > USER_SPACE_END) {
+        return -EINVAL;
+    }
+    const size_t pgcnt = DIV_ROUNDUP(length, PAGE_SIZE);
+
+    vmem_t* vm = &sched_current()->vmem;
+    if (flags & MAP_FIXED) {
+        if (check_range(addr, length) == 0) {
+            return -EINVAL;
+        }
+        int err = vmem_unmap_range(vm, addr, pgcnt);
+        if (err < 0) {
+            return err;
+        }
+    } else {
+        // The hint is taken if the range is free, the lowest free range above MMAP_BASE is used otherwise.
+        addr = (void*)ALIGN_DOWN(addr, PAGE_SIZE);
+        if (check_range(addr, length) == 0 || vmem_find_free_range(vm, pgcnt, addr, addr + pgcnt * PAGE_SIZE) != addr) {
+            addr = vmem_find_free_range(vm, pgcnt, (void*)MMAP_BASE, (void*)USER_SPACE_END);
+            if (addr == NULL) {
+                return -ENOMEM;
+            }
+        }
+    }
+
+    int err = 0;
+    if ((flags & MAP_POPULATE) && prot != PROT_NONE) {
+        err = vmem_alloc_pages(vm, addr, pgcnt, prot_to_flags(prot));
+    } else {
+        err = vmem_reserve_pages(vm, addr, pgcnt, prot_to_flags(prot));
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    return (int64_t)addr;
+}
+
+int64_t sys_munmap(arch_regs_t* regs) {
+    void* addr = (void*)syscall_arg0(regs);
+    const uint64_t length = syscall_arg1(regs);
+
+    const size_t pgcnt = check_range(addr, length);
+    if (pgcnt == 0) {
+        return -EINVAL;
+    }
+    return vmem_unmap_range(&sched_current()->vmem, addr, pgcnt);
+}
+
+int64_t sys_mprotect(arch_regs_t* regs) {
+    void* addr = (void*)syscall_arg0(regs);
+    const uint64_t length = syscall_arg1(regs);
+    const uint64_t prot = syscall_arg2(regs);
+
+    const size_t pgcnt = check_range(addr, length);
+    if (pgcnt == 0 || (prot & ~PROT_MASK)) {
+        return -EINVAL;
+    }
+    return vmem_protect_range(&sched_current()->vmem, addr, pgcnt, prot_to_flags(prot));
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+/**
+ * Anonymous private mappings for user space. A mapping is just a reserved area of the task's address space,
+ * frames are allocated by the page fault handler on first touch, unless MAP_POPULATE asks to fault them in
+ * right away. Mappings are copied on write by fork, so MAP_SHARED isn't supported.
+ */
+
+// Protection bits. Pages are always readable and executable when they are accessible at all.
+#define PROT_NONE  0
+#define PROT_READ  (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define PROT_EXEC  (1 << 2)
+
+// Mapping flags.
+#define MAP_SHARED    (1 << 0)
+#define MAP_PRIVATE   (1 << 1)
+// Place the mapping exactly at addr, replacing whatever is mapped there.
+#define MAP_FIXED     (1 << 4)
+#define MAP_ANONYMOUS (1 << 5)
+// Allocate frames for the whole mapping before returning.
+#define MAP_POPULATE  (1 << 15)
+
+// Lowest address a mapping may take, so NULL dereferences keep faulting.
+#define MMAP_MIN_ADDR 0x10000
+
+// Mappings without MAP_FIXED are placed at the lowest free range above MMAP_BASE, unless addr hints a free range.
+#define MMAP_BASE     0x100000000
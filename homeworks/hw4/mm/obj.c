@@ -1,65 +1,353 @@
 #include "obj.h"
 #include "mm/frame_alloc.h"
+#include "arch/x86/arch.h"
 
 
-static void object_register_region(obj_alloc_t *alloc, void *start, const void *end) {
-    BUG_ON_NULL(alloc);
-    BUG_ON(alloc->obj_size > PAGE_SIZE);
-    BUG_ON(start > end);
-    
-    if (start == end) {
+// Allocators, which own at least one slab. Linked through next_alloc.
+static obj_alloc_t *allocs_head = NULL;
+
+// slab_header_size returns how much space the header takes in the slab memory.
+static inline size_t slab_header_size(const obj_alloc_t *alloc) {
+    return alloc->off_slab ? 0 : ALIGN_UP(sizeof(struct obj_slab), alloc->align);
+}
+
+static inline size_t slab_size(const obj_alloc_t *alloc) {
+    return (size_t)PAGE_SIZE << alloc->slab_order;
+}
+
+static inline void *slab_obj(const obj_alloc_t *alloc, struct obj_slab *slab, size_t idx) {
+    return slab->objs + idx * alloc->stride;
+}
+
+static inline size_t slab_obj_idx(const obj_alloc_t *alloc, struct obj_slab *slab, void *obj) {
+    return (obj - slab->objs) / alloc->stride;
+}
+
+// slab_link returns the free list index of a free object.
+static inline uint16_t *slab_link(const obj_alloc_t *alloc, void *obj) {
+    return obj + alloc->link_offset;
+}
+
+// slab_setup picks the slab order for the allocator. Starting from the smallest order, which fits an object,
+// the first one wasting no more than 1/8 of a slab wins, otherwise the one with the lowest waste ratio.
+static void slab_setup(obj_alloc_t *alloc) {
+    // Objects with a constructor keep their state while free, so the free list index is placed after them.
+    alloc->link_offset = alloc->ctor ? ALIGN_UP(alloc->obj_size, _Alignof(uint16_t)) : 0;
+    alloc->stride = alloc->ctor ? ALIGN_UP(alloc->link_offset + sizeof(uint16_t), alloc->align) : alloc->obj_size;
+    alloc->off_slab = alloc->stride >= OBJ_OFF_SLAB_MIN_SIZE;
+
+    size_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < slab_header_size(alloc) + alloc->stride) {
+        order++;
+    }
+    BUG_ON((1ull << order) > FRAMES_ALLOC_MAX);
+
+    // Objects, which need more than OBJ_SLAB_MAX_ORDER anyway, may take a couple more orders to fit better.
+    size_t max_order = order > OBJ_SLAB_MAX_ORDER ? order + 2 : OBJ_SLAB_MAX_ORDER;
+    if ((1ull << max_order) > FRAMES_ALLOC_MAX) {
+        max_order = __builtin_ctzll(FRAMES_ALLOC_MAX);
+    }
+
+    size_t best_order = order;
+    size_t best_waste = (size_t)PAGE_SIZE << order;  // i.e. the ratio of 1
+    for (; order <= max_order; order++) {
+        const size_t size = (size_t)PAGE_SIZE << order;
+        const size_t waste = (size - slab_header_size(alloc)) % alloc->stride;
+
+        // Compare waste / size ratios.
+        if ((waste << best_order) < (best_waste << order)) {
+            best_order = order;
+            best_waste = waste;
+        }
+
+        if (waste * 8 <= size) {
+            break;
+        }
+    }
+
+    alloc->slab_order = best_order;
+
+    size_t capacity = (slab_size(alloc) - slab_header_size(alloc)) / alloc->stride;
+    if (capacity >= OBJ_SLAB_FREE_END) {
+        capacity = OBJ_SLAB_FREE_END - 1;
+    }
+    alloc->slab_capacity = capacity;
+}
+
+// slab_next_color returns color offset for a new slab. Colors step by a cache line through the space,
+// which is left unused at the end of a slab anyway.
+static size_t slab_next_color(obj_alloc_t *alloc) {
+    if (!(alloc->flags & OBJ_COLOR)) {
+        return 0;
+    }
+
+    const size_t step = ALIGN_UP(CACHE_LINE_SIZE_BYTES, alloc->align);
+    const size_t spare = slab_size(alloc) - slab_header_size(alloc) - alloc->slab_capacity * alloc->stride;
+
+    const size_t color = alloc->next_color;
+    alloc->next_color = color + step <= spare ? color + step : 0;
+
+    return color;
+}
+
+static void slab_list_push(struct obj_slab **head, struct obj_slab *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(struct obj_slab **head, struct obj_slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static void *slab_alloc(obj_alloc_t *alloc);
+static void slab_free(obj_alloc_t *alloc, void *obj);
+
+// Headers of slabs with big objects.
+static obj_alloc_t slab_header_alloc = OBJ_ALLOC_INIT(sizeof(struct obj_slab), _Alignof(struct obj_slab), OBJ_NO_MAGAZINES);
+
+// slab_create allocates a new slab and links all its objects into its free list.
+static struct obj_slab *slab_create(obj_alloc_t *alloc) {
+    if (alloc->slab_capacity == 0) {
+        slab_setup(alloc);
+    }
+
+    const size_t pages = 1ull << alloc->slab_order;
+    void * const mem = frames_alloc(pages, FRAME_NO_FLAGS);
+    if (!mem) {
+        return NULL;
+    }
+
+    struct obj_slab *slab = mem;
+    if (alloc->off_slab && !(slab = slab_alloc(&slab_header_alloc))) {
+        frames_free(mem, pages);
+        return NULL;
+    }
+
+    *slab = (struct obj_slab){
+        .alloc = alloc,
+        .mem = mem,
+        .objs = mem + slab_header_size(alloc) + slab_next_color(alloc),
+        .inuse = 0,
+        .free = 0,
+    };
+
+    const size_t capacity = alloc->slab_capacity;
+    for (size_t idx = 0; idx < capacity; idx++) {
+        void * const obj = slab_obj(alloc, slab, idx);
+        *slab_link(alloc, obj) = idx + 1 < capacity ? idx + 1 : OBJ_SLAB_FREE_END;
+        if (alloc->ctor) {
+            alloc->ctor(obj);
+        }
+    }
+
+    frame_t * const frames = frame_from_addr(mem);
+    for (size_t i = 0; i < pages; i++) {
+        frames[i].private = slab;
+        frames[i].flags |= FRAME_STATE_SLAB;
+    }
+
+    if (!alloc->registered) {
+        alloc->registered = true;
+        alloc->next_alloc = allocs_head;
+        allocs_head = alloc;
+    }
+
+    return slab;
+}
+
+// slab_destroy returns memory of an empty slab to the frame allocator.
+static void slab_destroy(obj_alloc_t *alloc, struct obj_slab *slab) {
+    const size_t pages = 1ull << alloc->slab_order;
+    void * const mem = slab->mem;
+
+    frame_t * const frames = frame_from_addr(mem);
+    for (size_t i = 0; i < pages; i++) {
+        frames[i].private = NULL;
+        frames[i].flags &= ~FRAME_STATE_SLAB;
+    }
+
+    if (alloc->off_slab) {
+        slab_free(&slab_header_alloc, slab);
+    }
+    frames_free(mem, pages);
+}
+
+// slab_alloc takes an object from the allocator's slabs. Must be called with interrupts disabled.
+static void *slab_alloc(obj_alloc_t *alloc) {
+    // Prefer partial slabs, so that empty ones can be reclaimed.
+    struct obj_slab *slab = alloc->partial;
+    if (!slab && (slab = alloc->empty)) {
+        slab_list_remove(&alloc->empty, slab);
+        alloc->empty_count--;
+        slab_list_push(&alloc->partial, slab);
+    }
+
+    if (!slab) {
+        if (!(slab = slab_create(alloc))) {
+            return NULL;
+        }
+        slab_list_push(&alloc->partial, slab);
+    }
+
+    BUG_ON(slab->free == OBJ_SLAB_FREE_END);
+
+    void * const obj = slab_obj(alloc, slab, slab->free);
+    slab->free = *slab_link(alloc, obj);
+    slab->inuse++;
+
+    if (slab->free == OBJ_SLAB_FREE_END) {
+        slab_list_remove(&alloc->partial, slab);
+        slab_list_push(&alloc->full, slab);
+    }
+
+    return obj;
+}
+
+// slab_free returns an object to its slab. Must be called with interrupts disabled.
+static void slab_free(obj_alloc_t *alloc, void *obj) {
+    struct obj_slab * const slab = frame_from_addr(obj)->private;
+    BUG_ON(slab->alloc != alloc);
+    BUG_ON(slab->inuse == 0);
+
+    const bool was_full = slab->free == OBJ_SLAB_FREE_END;
+
+    *slab_link(alloc, obj) = slab->free;
+    slab->free = slab_obj_idx(alloc, slab, obj);
+    slab->inuse--;
+
+    if (was_full) {
+        slab_list_remove(&alloc->full, slab);
+        slab_list_push(&alloc->partial, slab);
+    }
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&alloc->partial, slab);
+        slab_list_push(&alloc->empty, slab);
+        alloc->empty_count++;
+    }
+}
+
+// Magazines are objects themselves, allocated without the magazine layer.
+static OBJ_ALLOC_DEFINE_FLAGS(magazine_alloc, struct obj_magazine, OBJ_NO_MAGAZINES);
+
+static struct obj_magazine *mag_list_pop(struct obj_magazine **head) {
+    struct obj_magazine *mag = *head;
+    if (mag) {
+        *head = mag->next;
+    }
+    return mag;
+}
+
+static void mag_list_push(struct obj_magazine **head, struct obj_magazine *mag) {
+    mag->next = *head;
+    *head = mag;
+}
+
+// depot_put_empty stores an empty magazine in the depot, or frees it if the depot has enough of them.
+static void depot_put_empty(obj_alloc_t *alloc, struct obj_magazine *mag) {
+    if (alloc->empty_mags_count >= OBJ_DEPOT_EMPTY_MAX) {
+        slab_free(&magazine_alloc, mag);
         return;
     }
 
-    struct obj_frame * const head = alloc->head;
-    const size_t obj_size = alloc->obj_size;
+    mag_list_push(&alloc->empty_mags, mag);
+    alloc->empty_mags_count++;
+}
 
-    for (void *frame = start; frame + obj_size < end; frame += obj_size) {
-        struct obj_frame * const node = frame;
-        
-        // TODO: May be optimized, but who cares, really)...
-        node->prev = head->prev;
-        node->next = head;
-        head->prev->next = node;
-        head->prev = node;
+// depot_get_empty takes an empty magazine from the depot or allocates a new one.
+static struct obj_magazine *depot_get_empty(obj_alloc_t *alloc) {
+    struct obj_magazine *mag = mag_list_pop(&alloc->empty_mags);
+    if (mag) {
+        alloc->empty_mags_count--;
+    } else {
+        mag = slab_alloc(&magazine_alloc);
+        if (!mag) {
+            return NULL;
+        }
     }
+
+    mag->next = NULL;
+    mag->rounds = 0;
+    return mag;
 }
 
-// Returns true on success.
-static bool object_expand(obj_alloc_t *alloc) {
-    BUG_ON_NULL(alloc);
-    BUG_ON(alloc->obj_size > PAGE_SIZE);
+// magazine_alloc_obj takes an object from the current CPU's magazines, exchanging an empty one for a full one
+// with the depot if needed. Returns NULL if there are no cached objects. Must be called with interrupts disabled.
+static void *magazine_alloc_obj(obj_alloc_t *alloc) {
+    struct obj_cpu_cache * const cc = &alloc->cpus[arch_cpu_id()];
 
-    if (alloc->head && alloc->head->prev != alloc->head->next) {
-        // No expansion necessary
-        return true;
+    if (cc->loaded && cc->loaded->rounds > 0) {
+        return cc->loaded->objs[--cc->loaded->rounds];
     }
-    
-    void * const page = frame_alloc();
-    if (!page) {
-        return false;
+
+    if (cc->previous && cc->previous->rounds > 0) {
+        struct obj_magazine * const mag = cc->previous;
+        cc->previous = cc->loaded;
+        cc->loaded = mag;
+        return mag->objs[--mag->rounds];
+    }
+
+    struct obj_magazine * const full = mag_list_pop(&alloc->full_mags);
+    if (!full) {
+        return NULL;
+    }
+
+    if (cc->previous) {
+        depot_put_empty(alloc, cc->previous);
     }
+    cc->previous = cc->loaded;
+    cc->loaded = full;
 
-    const bool with_header = !alloc->head;
+    return full->objs[--full->rounds];
+}
 
-    if (with_header) {
-        struct obj_frame * const head = page;
-        alloc->head = head;
+// magazine_free_obj puts an object to the current CPU's magazines, exchanging a full one for an empty one
+// with the depot if needed. Returns false if no magazine could be found. Must be called with interrupts disabled.
+static bool magazine_free_obj(obj_alloc_t *alloc, void *obj) {
+    struct obj_cpu_cache * const cc = &alloc->cpus[arch_cpu_id()];
 
-        *head = (struct obj_frame){
-            .prev = head,
-            .next = head
-        };
+    if (cc->loaded && cc->loaded->rounds < OBJ_MAGAZINE_SIZE) {
+        cc->loaded->objs[cc->loaded->rounds++] = obj;
+        return true;
+    }
+
+    if (cc->previous && cc->previous->rounds == 0) {
+        struct obj_magazine * const mag = cc->previous;
+        cc->previous = cc->loaded;
+        cc->loaded = mag;
+        mag->objs[mag->rounds++] = obj;
+        return true;
     }
 
-    object_register_region(alloc, page + (with_header ? alloc->obj_size : 0), page + PAGE_SIZE);
+    struct obj_magazine * const empty = depot_get_empty(alloc);
+    if (!empty) {
+        return false;
+    }
+
+    if (cc->previous) {
+        mag_list_push(&alloc->full_mags, cc->previous);
+    }
+    cc->previous = cc->loaded;
+    cc->loaded = empty;
 
+    empty->objs[empty->rounds++] = obj;
     return true;
 }
 
 void *object_alloc(obj_alloc_t *alloc) {
     BUG_ON_NULL(alloc);
-    BUG_ON(alloc->obj_size > PAGE_SIZE);
+    BUG_ON(alloc->align == 0 || (alloc->align & (alloc->align - 1)));
 
     if (alloc->obj_size == 0) {
         // This is an invalid address, but writing to it mustn't be done anyway,
@@ -67,19 +355,19 @@ void *object_alloc(obj_alloc_t *alloc) {
         return (void *)1;
     }
 
-    if (!object_expand(alloc)) {
-        return NULL;
-    }
-    
-    struct obj_frame * const head = alloc->head;
+    uint64_t irq = irq_save();
 
-    BUG_ON(head->next == head->prev);
+    void *obj = NULL;
+    if (!(alloc->flags & OBJ_NO_MAGAZINES)) {
+        obj = magazine_alloc_obj(alloc);
+    }
+    if (!obj) {
+        obj = slab_alloc(alloc);
+    }
 
-    struct obj_frame * const node = head->next;
-    node->next->prev = head;
-    head->next = node->next;
+    irq_restore(irq);
 
-    return node;
+    return obj;
 }
 
 void object_free(obj_alloc_t *alloc, void *obj) {
@@ -93,12 +381,82 @@ void object_free(obj_alloc_t *alloc, void *obj) {
         // No allocations have been done in this case, so no release is necessary.
         return;
     }
-    
-    struct obj_frame * const head = alloc->head;
-    struct obj_frame * const node = obj;
 
-    node->next = head;
-    node->prev = head->prev;
-    head->prev->next = node;
-    head->prev = node;
+    BUG_ON(object_alloc_of(obj) != alloc);
+
+    uint64_t irq = irq_save();
+
+    if ((alloc->flags & OBJ_NO_MAGAZINES) || !magazine_free_obj(alloc, obj)) {
+        slab_free(alloc, obj);
+    }
+
+    irq_restore(irq);
+}
+
+// magazine_flush returns all objects from a magazine to their slabs and frees the magazine.
+static void magazine_flush(obj_alloc_t *alloc, struct obj_magazine *mag) {
+    while (mag->rounds > 0) {
+        slab_free(alloc, mag->objs[--mag->rounds]);
+    }
+    slab_free(&magazine_alloc, mag);
+}
+
+obj_alloc_t *object_alloc_of(const void *obj) {
+    const frame_t *frame = frame_from_addr(obj);
+    if (!frame || !(frame->flags & FRAME_STATE_SLAB)) {
+        return NULL;
+    }
+
+    return ((struct obj_slab *)frame->private)->alloc;
+}
+
+// depot_flush flushes all magazines of the depot and the current CPU. Magazines of other CPUs can only be
+// flushed by their owners, so they are left alone.
+static void depot_flush(obj_alloc_t *alloc) {
+    struct obj_magazine *mag = NULL;
+
+    while ((mag = mag_list_pop(&alloc->full_mags))) {
+        magazine_flush(alloc, mag);
+    }
+
+    while ((mag = mag_list_pop(&alloc->empty_mags))) {
+        alloc->empty_mags_count--;
+        magazine_flush(alloc, mag);
+    }
+
+    struct obj_cpu_cache * const cc = &alloc->cpus[arch_cpu_id()];
+    if (cc->loaded) {
+        magazine_flush(alloc, cc->loaded);
+        cc->loaded = NULL;
+    }
+    if (cc->previous) {
+        magazine_flush(alloc, cc->previous);
+        cc->previous = NULL;
+    }
+}
+
+size_t object_reclaim() {
+    size_t freed = 0;
+
+    uint64_t irq = irq_save();
+
+    for (obj_alloc_t *alloc = allocs_head; alloc; alloc = alloc->next_alloc) {
+        if (!(alloc->flags & OBJ_NO_MAGAZINES)) {
+            depot_flush(alloc);
+        }
+    }
+
+    for (obj_alloc_t *alloc = allocs_head; alloc; alloc = alloc->next_alloc) {
+        struct obj_slab *slab = NULL;
+        while ((slab = alloc->empty)) {
+            slab_list_remove(&alloc->empty, slab);
+            alloc->empty_count--;
+            slab_destroy(alloc, slab);
+            freed += 1ull << alloc->slab_order;
+        }
+    }
+
+    irq_restore(irq);
+
+    return freed;
 }
@@ -1,27 +1,145 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "common.h"
 #include "defs.h"
 #include "kernel/panic.h"
 
-struct obj_frame {
-    struct obj_frame *prev,
-                     *next;
-} __attribute__((aligned(CACHE_LINE_SIZE_BYTES)));
-static_assert(sizeof(struct obj_frame) == CACHE_LINE_SIZE_BYTES, "Bad size");
+/**
+ * Objects are carved from slabs, naturally aligned buddy blocks of 2^slab_order pages.
+ * Small objects keep the slab header at the start of the slab, big ones (OBJ_OFF_SLAB_MIN_SIZE
+ * and above) keep it off-slab, so e.g. 2048 byte objects fill a page exactly. Each slab frame
+ * is marked with FRAME_STATE_SLAB and points to the header, which is how objects find their slab.
+ * Slab order is chosen once per allocator to keep the unused tail of a slab small.
+ *
+ * Each allocator keeps its slabs on three lists: full, partial and empty. Allocations
+ * are served from partial slabs first, so objects stay packed in as few pages as possible.
+ * Empty slabs are kept for reuse until the frame allocator runs out of memory and calls
+ * object_reclaim.
+ *
+ * In front of the slab layer there is a magazine layer, as described by Bonwick & Adams.
+ * Each CPU owns a loaded and a previous magazine, small stacks of free objects, and most
+ * allocations and frees only push or pop them with interrupts disabled. Only full and empty
+ * magazines are exchanged with the allocator's depot, so the shared lists are touched once
+ * per OBJ_MAGAZINE_SIZE operations at most.
+ *
+ * An allocator may have a constructor, which runs once for every object when its slab is created.
+ * Objects are expected to be freed in their constructed state, so allocations don't repeat the
+ * initialization. Free list indices of such objects are kept after the objects, not inside them.
+ *
+ * Objects are aligned as their type requires, not to the cache line. With OBJ_COLOR,
+ * consecutive slabs shift their objects by a cache line, using the space left at the end
+ * of a slab, so the same objects of different slabs don't compete for the same cache sets.
+ */
+
+// Allocator flags.
+#define OBJ_NO_FLAGS     0
+// Slabs get cache color offsets.
+#define OBJ_COLOR        (1 << 0)
+// Objects go straight to slabs, bypassing the magazine layer.
+#define OBJ_NO_MAGAZINES (1 << 1)
+
+// Number of objects a single magazine holds. Chosen so that a magazine takes two cache lines.
+#define OBJ_MAGAZINE_SIZE 14
+
+// Empty magazines kept in a depot, extra ones are freed.
+#define OBJ_DEPOT_EMPTY_MAX 4
+
+struct obj_magazine {
+    struct obj_magazine *next;
+    size_t rounds;
+    void *objs[OBJ_MAGAZINE_SIZE];
+};
+static_assert(sizeof(struct obj_magazine) == 2 * CACHE_LINE_SIZE_BYTES, "Bad size");
+
+struct obj_cpu_cache {
+    struct obj_magazine *loaded,
+                        *previous;
+};
+
+// Objects of this size and bigger get off-slab headers.
+#define OBJ_OFF_SLAB_MIN_SIZE (PAGE_SIZE / 8)
+
+// Slabs are made of up to 2^OBJ_SLAB_MAX_ORDER pages, unless objects are so big that they need more.
+#define OBJ_SLAB_MAX_ORDER 3
+
+// Marks the end of a slab free list.
+#define OBJ_SLAB_FREE_END 0xffff
+
+struct obj_alloc;
+
+// obj_slab is a slab header. Free objects are linked by their indices, stored in the first bytes of each free object.
+struct obj_slab {
+    struct obj_slab *prev,
+                    *next;
+    struct obj_alloc *alloc;
+    // Start of the slab memory.
+    void *mem;
+    // First object, shifted by the header and the color.
+    void *objs;
+    uint16_t inuse;
+    uint16_t free;
+};
+static_assert(sizeof(struct obj_slab) == 48, "Bad size");
 
 typedef struct obj_alloc {
     size_t obj_size;
-    struct obj_frame *head;
+    size_t align;
+    uint64_t flags;
+    // Optional constructor, see above.
+    void (*ctor)(void *obj);
+    // Slab geometry, computed when the first slab is created.
+    size_t stride;
+    size_t link_offset;
+    size_t slab_order;
+    size_t slab_capacity;
+    bool off_slab;
+    // Color of the next slab.
+    size_t next_color;
+    struct obj_slab *full,
+                    *partial,
+                    *empty;
+    size_t empty_count;
+    // Depot of full and empty magazines, linked through next.
+    struct obj_magazine *full_mags,
+                        *empty_mags;
+    size_t empty_mags_count;
+    struct obj_cpu_cache cpus[MAX_CPUS];
+    // All allocators with slabs are linked together for object_reclaim.
+    struct obj_alloc *next_alloc;
+    bool registered;
 } obj_alloc_t;
 
-#define OBJ_ALLOC_DEFINE(VAR, TYPE) obj_alloc_t VAR = {         \
-    .obj_size = ALIGN_UP(sizeof(TYPE), CACHE_LINE_SIZE_BYTES),  \
-    .head = NULL                                                \
+// Free objects hold a free list index, so they can't be smaller or less aligned than it.
+#define OBJ_SIZE_MIN(SIZE)   ((SIZE) < sizeof(uint16_t) ? sizeof(uint16_t) : (SIZE))
+#define OBJ_ALIGN_MIN(ALIGN) ((ALIGN) < _Alignof(uint16_t) ? _Alignof(uint16_t) : (ALIGN))
+
+#define OBJ_ALLOC_INIT_CTOR(SIZE, ALIGN, FLAGS, CTOR) {            \
+    .obj_size = ALIGN_UP(OBJ_SIZE_MIN(SIZE), OBJ_ALIGN_MIN(ALIGN)), \
+    .align = OBJ_ALIGN_MIN(ALIGN),                                  \
+    .flags = (FLAGS),                                               \
+    .ctor = (CTOR),                                                 \
+    .full = NULL,                                                   \
+    .partial = NULL,                                                \
+    .empty = NULL                                                   \
 }
 
+#define OBJ_ALLOC_INIT(SIZE, ALIGN, FLAGS) OBJ_ALLOC_INIT_CTOR(SIZE, ALIGN, FLAGS, NULL)
+
+// OBJ_CTOR_OR_NULL expands to the optional constructor argument or NULL.
+#define OBJ_CTOR_OR_NULL_(_, CTOR, ...) CTOR
+#define OBJ_CTOR_OR_NULL(...) OBJ_CTOR_OR_NULL_(_ __VA_OPT__(,) __VA_ARGS__, NULL, NULL)
+
+// OBJ_ALLOC_DEFINE(VAR, TYPE[, CTOR]) defines an allocator of TYPE objects with an optional constructor.
+#define OBJ_ALLOC_DEFINE(VAR, TYPE, ...) \
+    obj_alloc_t VAR = OBJ_ALLOC_INIT_CTOR(sizeof(TYPE), _Alignof(TYPE), OBJ_NO_FLAGS, OBJ_CTOR_OR_NULL(__VA_ARGS__))
+
+#define OBJ_ALLOC_DEFINE_FLAGS(VAR, TYPE, FLAGS, ...) \
+    obj_alloc_t VAR = OBJ_ALLOC_INIT_CTOR(sizeof(TYPE), _Alignof(TYPE), FLAGS, OBJ_CTOR_OR_NULL(__VA_ARGS__))
+
 #define OBJ_ALLOC_DECLARE(VAR) obj_alloc_t VAR
 
 // object_alloc allocates single object and returns its virtual address.
@@ -29,3 +147,10 @@ void* object_alloc(obj_alloc_t* alloc);
 
 // object_free frees obj associated with given allocator.
 void object_free(obj_alloc_t* alloc, void* obj);
+
+// object_alloc_of returns the allocator, which owns obj, or NULL if obj doesn't belong to any object cache.
+obj_alloc_t* object_alloc_of(const void* obj);
+
+// object_reclaim returns objects from depots to their slabs and empty slabs of all allocators to the frame allocator.
+// Returns the number of freed frames.
+size_t object_reclaim();
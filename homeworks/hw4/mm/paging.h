@@ -10,6 +10,12 @@
 #define PTE_PRESENT   (1ull << 0)
 #define PTE_USER      (1ull << 2)
 #define PTE_WRITE     (1ull << 1)
+// Translation is kept in TLB across CR3 writes, used for the kernel half. Leaf entries only.
+#define PTE_GLOBAL    (1ull << 8)
+// Software-defined: read-only PTE of a page, which is shared after fork and gets copied on write.
+#define PTE_COW       (1ull << 9)
+// Software-defined: non-present leaf entry of an inaccessible page, which still holds its frame.
+#define PTE_PROTNONE  (1ull << 10)
 
 #define PTE_FLAGS_MASK ((1ull << 12) - 1)
 #define PTE_ADDR_MASK  ((1ull << 48) - 1)
@@ -5,6 +5,11 @@
 #include "kernel/panic.h"
 #include "obj.h"
 #include "common.h"
+#include "linker.h"
+#include "arch/x86/arch.h"
+
+// Kernel half of the PML4, starting from this entry, is the same in all address spaces.
+#define KERNEL_PML4E_START (PTE_COUNT / 2)
 
 static uint64_t convert_flags(uint64_t flags) {
     uint64_t pte_flags = 0;
@@ -14,77 +19,128 @@ static uint64_t convert_flags(uint64_t flags) {
     if (flags & VMEM_WRITE) {
         pte_flags |= PTE_WRITE;
     }
+    if (flags & VMEM_GLOBAL) {
+        pte_flags |= PTE_GLOBAL;
+    }
     return pte_flags;
 }
 
+// table_flags returns flags of the upper level entries, which lead to virt_addr. Access rights of user pages are up to
+// their leaf entries only, so changing them never has to touch the upper levels.
+static uint64_t table_flags(void* virt_addr, uint64_t raw_flags) {
+    if (PML4E_FROM_ADDR(virt_addr) < KERNEL_PML4E_START) {
+        return PTE_USER | PTE_WRITE;
+    }
+    return raw_flags;
+}
+
 static void* ensure_next_table(pte_t* tbl, size_t idx, uint64_t raw_flags) {
+    // Only the leaf entries are global.
+    raw_flags &= ~PTE_GLOBAL;
+
     pte_t pte = tbl[idx];
     void* next_tbl = NULL;
     if (pte & PTE_PRESENT) {
         next_tbl = PHYS_TO_VIRT(PTE_ADDR(pte));
         tbl[idx] |= raw_flags;
     } else {
-        next_tbl = frame_alloc();
+        next_tbl = frame_alloc(FRAME_ZERO);
         if (next_tbl == NULL) {
             return NULL;
         }
-        memset(next_tbl, '\0', PAGE_SIZE);
         tbl[idx] = (uint64_t)VIRT_TO_PHYS(next_tbl) | PTE_PRESENT | raw_flags;
     }
     return next_tbl;
 }
 
-// A helper for translate_addr.
-static inline void *_extract_addr_in_page(pte_t pte, void *vaddr, size_t pgbits) {
-    return PHYS_TO_VIRT(PTE_ADDR(pte)) + (((uint64_t)vaddr) & ((1 << pgbits) - 1));
-}
+// walk_pde returns the page directory entry, which covers vaddr, or NULL if there is no page directory for it.
+// Then *span is set to the size of the region covered by the entry, at which the walk has stopped.
+static pte_t* walk_pde(vmem_t* vm, void* vaddr, uint64_t* span) {
+    pte_t pml4e = vm->pml4->entries[PML4E_FROM_ADDR(vaddr)];
+    if (!(pml4e & PTE_PRESENT)) {
+        *span = 1ull << 39;
+        return NULL;
+    }
 
-// translate_address translate virtual address vaddr into physical address and returns virtual address from direct mapping.
-static int translate_address(vmem_t* vm, void* vaddr, void** paddr) {
-    BUG_ON_NULL(vm);
-    BUG_ON_NULL(paddr);
+    pte_t pdpe = ((pdpt_t *)PHYS_TO_VIRT(PTE_ADDR(pml4e)))->entries[PDPE_FROM_ADDR(vaddr)];
+    if (!(pdpe & PTE_PRESENT) || (pdpe & PTE_PAGE_SIZE)) {
+        *span = 1ull << 30;
+        return NULL;
+    }
 
-    uint64_t signx = SIGNX_FROM_ADDR(vaddr);
-    uint64_t signb = SIGNB_FROM_ADDR(vaddr);
+    return &((pgdir_t *)PHYS_TO_VIRT(PTE_ADDR(pdpe)))->entries[PDE_FROM_ADDR(vaddr)];
+}
 
-    if (!((signb == 0 && signx == 0x0000) || 
-          (signb == 1 && signx == 0xffff))) {
-        return -EINVAL;
-    }
+// lookup_pde returns the page directory entry, which covers vaddr, or NULL if there is no page directory for it.
+static pte_t* lookup_pde(vmem_t* vm, void* vaddr) {
+    uint64_t span;
+    return walk_pde(vm, vaddr, &span);
+}
 
-    pte_t pml4e = vm->pml4->entries[PML4E_FROM_ADDR(vaddr)];
-    if (!pml4e & PTE_PRESENT) {
-        return -EINVAL;
+// lookup_pte returns the last level PTE, which maps vaddr, or NULL if there is no page table for it.
+static pte_t* lookup_pte(vmem_t* vm, void* vaddr) {
+    pte_t* pde = lookup_pde(vm, vaddr);
+    if (pde == NULL || !(*pde & PTE_PRESENT) || (*pde & PTE_PAGE_SIZE)) {
+        return NULL;
     }
 
-    BUG_ON(pml4e & PTE_PAGE_SIZE);
+    return &((pgtbl_t *)PHYS_TO_VIRT(PTE_ADDR(*pde)))->entries[PTE_FROM_ADDR(vaddr)];
+}
 
-    pte_t pdpe = ((pdpt_t *)PTE_ADDR(pml4e))->entries[PDPE_FROM_ADDR(vaddr)];
-    if (!pdpe & PTE_PRESENT) {
-        return -EINVAL;
-    }
+// pte_mapped checks that entry pte maps something: either a present one or a leaf entry of an inaccessible page.
+static bool pte_mapped(pte_t pte) {
+    return pte & (PTE_PRESENT | PTE_PROTNONE);
+}
 
-    if (pdpe & PTE_PAGE_SIZE) {
-        *paddr = _extract_addr_in_page(pdpe, vaddr, 9 + 9 + 12);
-        return 0;
+/**
+ * Big enough parts of user areas are backed by huge pages: 2 MiB aligned blocks of frames mapped by
+ * a single page directory entry. The frames of a block are still referenced one by one, so a huge page
+ * is split by replacing its entry with a page table of 4 KiB pages, which take over the references.
+ * This happens once only a part of a huge page is needed: on a copy-on-write fault or when 4 KiB pages
+ * get mapped over it.
+ */
+
+#define HUGE_PAGE_SIZE  (2 * MB)
+#define HUGE_PAGE_PAGES (HUGE_PAGE_SIZE / PAGE_SIZE)
+
+// split_huge_page replaces huge page entry *pde, which maps virt_addr, with a page table of 4 KiB pages.
+static int split_huge_page(pte_t* pde, void* virt_addr) {
+    pgtbl_t* pgtbl = frame_alloc(FRAME_NO_FLAGS);
+    if (pgtbl == NULL) {
+        return -ENOMEM;
     }
 
-    pte_t pde = ((pgdir_t *)PTE_ADDR(pdpe))->entries[PDE_FROM_ADDR(vaddr)];
-    if (!pde & PTE_PRESENT) {
-        return -EINVAL;
+    const uint64_t phys_addr = (uint64_t)PTE_ADDR(*pde);
+    const uint64_t flags = *pde & PTE_FLAGS_MASK & ~PTE_PAGE_SIZE;
+    for (size_t i = 0; i < PTE_COUNT; i++) {
+        pgtbl->entries[i] = (phys_addr + i * PAGE_SIZE) | flags;
     }
 
-    if (pde & PTE_PAGE_SIZE) {
-        *paddr = _extract_addr_in_page(pde, vaddr, 9 + 12);
-        return 0;
+    // Access rights are up to the new PTEs, e.g. copy-on-write ones become writable one by one.
+    *pde = (uint64_t)VIRT_TO_PHYS(pgtbl) | PTE_PRESENT | table_flags(virt_addr, (flags & PTE_USER) | PTE_WRITE);
+    x86_invlpg(virt_addr);
+    return 0;
+}
+
+// map_huge_page backs the 2 MiB aligned virt_addr with a huge page, if there is a free 2 MiB block
+// and nothing is mapped there yet. Returns -ENOMEM otherwise, so the caller falls back to 4 KiB pages.
+static int map_huge_page(vmem_t* vm, void* virt_addr, uint64_t flags) {
+    pte_t* pde = lookup_pde(vm, virt_addr);
+    if (pde != NULL && pte_mapped(*pde)) {
+        return -ENOMEM;
     }
 
-    pte_t pte = ((pgtbl_t *)PTE_ADDR(pde))->entries[PTE_FROM_ADDR(vaddr)];
-    if (!pte & PTE_PRESENT) {
-        return -EINVAL;
+    // Huge pages are best effort, so caches aren't flushed for them, 4 KiB pages are used instead.
+    void* frames = frames_alloc(HUGE_PAGE_PAGES, FRAME_ZERO | FRAME_NO_RECLAIM);
+    if (frames == NULL) {
+        return -ENOMEM;
     }
 
-    *paddr = _extract_addr_in_page(pte, vaddr, 12);
+    int err = vmem_map_2mb_page(vm, virt_addr, VIRT_TO_PHYS(frames), flags);
+    if (err < 0) {
+        frames_free(frames, HUGE_PAGE_PAGES);
+        return err;
+    }
     return 0;
 }
 
@@ -94,7 +150,7 @@ int vmem_map_1gb_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t fla
 
     flags = convert_flags(flags);
 
-    pdpt_t* pdpt = ensure_next_table(vm->pml4->entries, PML4E_FROM_ADDR(virt_addr), flags);
+    pdpt_t* pdpt = ensure_next_table(vm->pml4->entries, PML4E_FROM_ADDR(virt_addr), table_flags(virt_addr, flags));
     if (pdpt == NULL) {
         return -ENOMEM;
     }
@@ -111,12 +167,12 @@ int vmem_map_2mb_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t fla
 
     flags = convert_flags(flags);
 
-    pdpt_t* pdpt = ensure_next_table(vm->pml4->entries, PML4E_FROM_ADDR(virt_addr), flags);
+    pdpt_t* pdpt = ensure_next_table(vm->pml4->entries, PML4E_FROM_ADDR(virt_addr), table_flags(virt_addr, flags));
     if (pdpt == NULL) {
         return -ENOMEM;
     }
 
-    pgdir_t* pgdir = ensure_next_table(pdpt->entries, PDPE_FROM_ADDR(virt_addr), flags);
+    pgdir_t* pgdir = ensure_next_table(pdpt->entries, PDPE_FROM_ADDR(virt_addr), table_flags(virt_addr, flags));
     if (pgdir == NULL) {
         return -ENOMEM;
     }
@@ -127,20 +183,32 @@ int vmem_map_2mb_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t fla
     return 0;
 }
 
-int vmem_map_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t flags) {
-    flags = convert_flags(flags);
+// ensure_pgtbl returns the page table, which maps virt_addr, creating missing tables on the way.
+static pgtbl_t* ensure_pgtbl(vmem_t* vm, void* virt_addr, uint64_t raw_flags) {
+    raw_flags = table_flags(virt_addr, raw_flags);
 
-    pdpt_t* pdpt = ensure_next_table(vm->pml4->entries, PML4E_FROM_ADDR(virt_addr), flags);
+    pdpt_t* pdpt = ensure_next_table(vm->pml4->entries, PML4E_FROM_ADDR(virt_addr), raw_flags);
     if (pdpt == NULL) {
-        return -ENOMEM;
+        return NULL;
     }
 
-    pgdir_t* pgdir = ensure_next_table(pdpt->entries, PDPE_FROM_ADDR(virt_addr), flags);
+    pgdir_t* pgdir = ensure_next_table(pdpt->entries, PDPE_FROM_ADDR(virt_addr), raw_flags);
     if (pgdir == NULL) {
-        return -ENOMEM;
+        return NULL;
+    }
+
+    pte_t* pde = &pgdir->entries[PDE_FROM_ADDR(virt_addr)];
+    if (pte_mapped(*pde) && (*pde & PTE_PAGE_SIZE) && split_huge_page(pde, virt_addr) < 0) {
+        return NULL;
     }
 
-    pgtbl_t* pgtbl = ensure_next_table(pgdir->entries, PDE_FROM_ADDR(virt_addr), flags);
+    return ensure_next_table(pgdir->entries, PDE_FROM_ADDR(virt_addr), raw_flags);
+}
+
+int vmem_map_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t flags) {
+    flags = convert_flags(flags);
+
+    pgtbl_t* pgtbl = ensure_pgtbl(vm, virt_addr, flags);
     if (pgtbl == NULL) {
         return -ENOMEM;
     }
@@ -149,96 +217,931 @@ int vmem_map_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t flags)
     return 0;
 }
 
-static OBJ_ALLOC_DEFINE(vmem_area_alloc, vmem_area_t);
+int vmem_map_pages(vmem_t* vm, void* virt_addr, void** frames, size_t pgcnt, uint64_t flags) {
+    BUG_ON(((uint64_t)virt_addr) % PAGE_SIZE);
 
-int vmem_alloc_pages(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags) {
-    size_t allocated = 0;
-    void* start_addr = virt_addr;
-    while (allocated < pgcnt) {
-        void* frame = frame_alloc();
-        if (frame == NULL) {
+    flags = convert_flags(flags);
+
+    size_t mapped = 0;
+    while (mapped < pgcnt) {
+        pgtbl_t* pgtbl = ensure_pgtbl(vm, virt_addr, flags);
+        if (pgtbl == NULL) {
             return -ENOMEM;
         }
-        memset(frame, '\0', PAGE_SIZE);
-        int err = vmem_map_page(vm, virt_addr, VIRT_TO_PHYS(frame), flags);
-        if (err < 0) {
+
+        // Fill consecutive entries up to the end of this page table without walking the upper levels again.
+        for (size_t idx = PTE_FROM_ADDR(virt_addr); idx < PTE_COUNT && mapped < pgcnt; idx++) {
+            pgtbl->entries[idx] = (uint64_t)VIRT_TO_PHYS(frames[mapped]) | PTE_PRESENT | flags;
+            virt_addr += PAGE_SIZE;
+            mapped++;
+        }
+    }
+
+    return 0;
+}
+
+// zero_page backs reads of untouched anonymous pages, so memory which is only read takes no frames.
+// It lives in kernel sections, so like user code it isn't refcounted: mappings of it are never released
+// and writes always get a frame of their own.
+static uint8_t zero_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static void* zero_page_phys() {
+    return (void*)((uint64_t)zero_page - KERNEL_SECTIONS_START + (uint64_t)&_phys_start_hh);
+}
+
+// map_zero_pages maps the zero page read-only at pgcnt pages starting at virt_addr, which lie within a single
+// page table, copy-on-write if flags allow writes.
+static int map_zero_pages(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags) {
+    flags = convert_flags(flags);
+
+    pgtbl_t* pgtbl = ensure_pgtbl(vm, virt_addr, flags);
+    if (pgtbl == NULL) {
+        return -ENOMEM;
+    }
+
+    pte_t entry = (uint64_t)zero_page_phys() | PTE_PRESENT | (flags & ~PTE_WRITE);
+    if (flags & PTE_WRITE) {
+        entry |= PTE_COW;
+    }
+    for (size_t i = 0; i < pgcnt; i++) {
+        pgtbl->entries[PTE_FROM_ADDR(virt_addr) + i] = entry;
+    }
+    return 0;
+}
+
+static OBJ_ALLOC_DEFINE(vmem_area_alloc, vmem_area_t);
+
+// range_is_free checks that pgcnt pages at start don't belong to any area.
+static bool range_is_free(vmem_t* vm, void* start, size_t pgcnt) {
+    vmem_area_t* next = vmem_tree_next(&vm->areas, start);
+    return next == NULL || next->start >= start + pgcnt * PAGE_SIZE;
+}
+
+// add_area records pgcnt pages starting at start as an area of vm. The area is merged with its neighbours
+// of the same flags, so consecutive mappings don't grow the tree.
+static int add_area(vmem_t* vm, void* start, size_t pgcnt, uint64_t flags) {
+    void* end = start + pgcnt * PAGE_SIZE;
+    if (!range_is_free(vm, start, pgcnt)) {
+        return -EINVAL;
+    }
+
+    vmem_area_t* prev = vmem_tree_prev(&vm->areas, start);
+    vmem_area_t* next = vmem_tree_next(&vm->areas, start);
+
+    const bool merge_prev = prev && vmem_area_end(prev) == start && prev->flags == flags;
+    const bool merge_next = next && next->start == end && next->flags == flags;
+
+    vmem_area_t* area = NULL;
+    if (merge_prev) {
+        // Subtree data of the ancestors depends on the area bounds, so it's reinserted.
+        area = prev;
+        vmem_tree_remove(&vm->areas, area);
+        area->pgcnt += pgcnt;
+    } else {
+        area = object_alloc(&vmem_area_alloc);
+        if (area == NULL) {
             return -ENOMEM;
         }
-        virt_addr += PAGE_SIZE;
-        allocated++;
+        area->start = start;
+        area->pgcnt = pgcnt;
+        area->flags = flags;
     }
 
-    vmem_area_t* area = object_alloc(&vmem_area_alloc);
-    area->start = start_addr;
-    area->pgcnt = pgcnt;
-    area->flags = flags;
-    area->next = vm->areas_head;
-    vm->areas_head = area;
+    if (merge_next) {
+        vmem_tree_remove(&vm->areas, next);
+        area->pgcnt += next->pgcnt;
+        object_free(&vmem_area_alloc, next);
+    }
 
+    vmem_tree_insert(&vm->areas, area);
     return 0;
 }
 
+// find_area returns the area containing virt_addr, or NULL if there is none.
+static vmem_area_t* find_area(vmem_t* vm, void* virt_addr) {
+    return vmem_tree_find(&vm->areas, virt_addr);
+}
+
+void* vmem_find_free_range(vmem_t* vm, size_t pgcnt, void* low, void* high) {
+    BUG_ON_NULL(vm);
+
+    return vmem_tree_find_gap(&vm->areas, pgcnt * PAGE_SIZE, low, high);
+}
+
+int vmem_alloc_pages(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags) {
+    int err = vmem_reserve_pages(vm, virt_addr, pgcnt, flags);
+    if (err < 0) {
+        return err;
+    }
+
+    err = vmem_populate_range(vm, virt_addr, pgcnt);
+    if (err < 0) {
+        vmem_unmap_range(vm, virt_addr, pgcnt);
+    }
+    return err;
+}
+
+int vmem_reserve_pages(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags) {
+    BUG_ON(((uint64_t)virt_addr) % PAGE_SIZE);
+
+    return add_area(vm, virt_addr, pgcnt, flags);
+}
+
 void vmem_init_from_current(vmem_t* vm) {
-    vm->pml4 = PHYS_TO_VIRT(x86_read_cr3());
-    vm->areas_head = NULL;
+    vm->pml4 = PHYS_TO_VIRT(PTE_ADDR(x86_read_cr3()));
+    vm->areas = (vmem_tree_t){};
+    vm->pcid = 0;
+    vm->pcid_generation = 0;
+}
+
+/**
+ * With CR4.PCIDE, TLB entries are tagged with the PCID of their address space, so switching to another
+ * address space doesn't have to flush them. PCIDs are handed out on the first switch to an address space
+ * and aren't reused within a generation, so entries tagged with a PCID always belong to its owner. Once
+ * all PCIDs of a generation are used, the whole TLB is flushed and a new generation starts, so every
+ * address space gets a new PCID on its next switch. PCID 0 is left to the boot address space.
+ * There is a single set of PCIDs while a single CPU runs, see arch_cpu_id.
+ */
+
+#define PCID_COUNT 4096
+
+static uint64_t pcid_generation = 1;
+static uint16_t pcid_next = 1;
+
+// assign_pcid gives vm a PCID, which wasn't used since the last flush of the whole TLB.
+static void assign_pcid(vmem_t* vm) {
+    if (pcid_next == PCID_COUNT) {
+        x86_flush_tlb_all();
+        pcid_generation++;
+        pcid_next = 1;
+    }
+
+    vm->pcid = pcid_next++;
+    vm->pcid_generation = pcid_generation;
 }
 
 void vmem_switch_to(vmem_t* vm) {
-    x86_write_cr3((uint64_t)VIRT_TO_PHYS(vm->pml4));
+    const uint64_t pml4 = (uint64_t)VIRT_TO_PHYS(vm->pml4);
+    if (!(x86_read_cr4() & CR4_PCIDE)) {
+        x86_write_cr3(pml4);
+        return;
+    }
+
+    uint64_t irq = irq_save();
+    if (vm->pcid_generation != pcid_generation) {
+        assign_pcid(vm);
+    }
+    x86_write_cr3(pml4 | vm->pcid | CR3_NOFLUSH);
+    irq_restore(irq);
+}
+
+// is_current checks whether vm is the active address space.
+static bool is_current(vmem_t* vm) {
+    return PTE_ADDR(x86_read_cr3()) == VIRT_TO_PHYS(vm->pml4);
+}
+
+void vmem_flush_tlb(vmem_t* vm) {
+    if (is_current(vm)) {
+        // Without the no-flush bit, entries of the current PCID are dropped.
+        x86_write_cr3(x86_read_cr3());
+    } else {
+        // Entries of an inactive address space are left behind, it gets a new PCID instead.
+        vm->pcid_generation = 0;
+    }
+}
+
+void vmem_flush_kernel_tlb() {
+    x86_flush_tlb_all();
+}
+
+void vmem_flush_batch_init(vmem_flush_batch_t* batch, vmem_t* vm) {
+    BUG_ON_NULL(batch);
+    BUG_ON_NULL(vm);
+
+    batch->vm = vm;
+    batch->page_count = 0;
+    batch->flush_all = false;
+    batch->freed_count = 0;
+}
+
+void vmem_flush_batch_add(vmem_flush_batch_t* batch, void* virt_addr) {
+    if (batch->page_count == VMEM_FLUSH_BATCH_PAGES) {
+        batch->flush_all = true;
+    }
+    if (!batch->flush_all) {
+        batch->pages[batch->page_count++] = virt_addr;
+    }
 }
 
+// put_frames releases references to pgcnt frames starting at frames. Frames, which don't belong to the frame allocator,
+// e.g. user code in kernel sections, aren't refcounted.
+static void put_frames(void* frames, size_t pgcnt) {
+    const frame_t* desc = frame_from_addr(frames);
+    if (desc == NULL || desc->chunk == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < pgcnt; i++) {
+        frame_put(frames + i * PAGE_SIZE);
+    }
+}
+
+// flush_batch_free releases pgcnt frames at frames once the TLB doesn't reference them any more.
+static void flush_batch_free(vmem_flush_batch_t* batch, void* frames, size_t pgcnt) {
+    if (batch->freed_count == VMEM_FLUSH_BATCH_FRAMES) {
+        vmem_flush_batch_apply(batch);
+    }
+    batch->freed[batch->freed_count].frames = frames;
+    batch->freed[batch->freed_count].pgcnt = pgcnt;
+    batch->freed_count++;
+}
+
+void vmem_flush_batch_apply(vmem_flush_batch_t* batch) {
+    BUG_ON_NULL(batch);
+
+    // Only the local TLB is flushed, see arch_cpu_id. Other CPUs running the address space would get the whole batch
+    // in a single shootdown IPI here, before the frames are released.
+    if (batch->flush_all || !is_current(batch->vm)) {
+        vmem_flush_tlb(batch->vm);
+    } else {
+        for (size_t i = 0; i < batch->page_count; i++) {
+            x86_invlpg(batch->pages[i]);
+        }
+    }
+
+    for (size_t i = 0; i < batch->freed_count; i++) {
+        put_frames(batch->freed[i].frames, batch->freed[i].pgcnt);
+    }
+
+    vmem_flush_batch_init(batch, batch->vm);
+}
+
+// destroy_areas frees the subtree of areas rooted at area.
+static void destroy_areas(vmem_area_t* area) {
+    if (area == NULL) {
+        return;
+    }
+    destroy_areas(area->left);
+    destroy_areas(area->right);
+    object_free(&vmem_area_alloc, area);
+}
+
+// Frames released by teardown are given back to the frame allocator in batches of VMEM_FREE_BATCH.
+#define VMEM_FREE_BATCH 32
+
+struct free_batch {
+    void* frames[VMEM_FREE_BATCH];
+    size_t count;
+};
+
+static void free_batch_add(struct free_batch* batch, void* frame) {
+    if (batch->count == VMEM_FREE_BATCH) {
+        frames_put_bulk(batch->count, batch->frames);
+        batch->count = 0;
+    }
+    batch->frames[batch->count++] = frame;
+}
+
+// destroy_table releases frames mapped by user page table tbl of the given level (4 for PML4, 1 for the last level),
+// as well as the tables below it. The kernel half of PML4 is shared and is left alone.
+static void destroy_table(pte_t* tbl, int level, struct free_batch* batch) {
+    const size_t count = level == 4 ? KERNEL_PML4E_START : PTE_COUNT;
+    for (size_t i = 0; i < count; i++) {
+        const pte_t pte = tbl[i];
+        if (!pte_mapped(pte)) {
+            continue;
+        }
+
+        void* addr = PHYS_TO_VIRT(PTE_ADDR(pte));
+        if (level == 1 || (level == 2 && (pte & PTE_PAGE_SIZE))) {
+            // Frames may be shared with other address spaces after fork, and user code isn't refcounted at all.
+            const frame_t* desc = frame_from_addr(addr);
+            if (desc == NULL || desc->chunk == NULL) {
+                continue;
+            }
+            const size_t pgcnt = level == 1 ? 1 : HUGE_PAGE_PAGES;
+            for (size_t j = 0; j < pgcnt; j++) {
+                free_batch_add(batch, addr + j * PAGE_SIZE);
+            }
+            continue;
+        }
+
+        BUG_ON(pte & PTE_PAGE_SIZE);
+        destroy_table(addr, level - 1, batch);
+        free_batch_add(batch, addr);
+    }
+}
 
 void vmem_destroy(vmem_t* vm) {
     BUG_ON_NULL(vm);
+    BUG_ON(is_current(vm));
 
-    vmem_area_t *next = NULL;
-    for (vmem_area_t *area = vm->areas_head; area; area = next) {
-        next = area->next;
+    destroy_areas(vm->areas.root);
+    vm->areas = (vmem_tree_t){};
 
-        const void *end = area->start + area->pgcnt;
-        for (void *pg = area->start; pg < end; pg += PAGE_SIZE) {
-            void *paddr = NULL;
+    // A single pass over the user half, instead of looking up every page of every area.
+    struct free_batch batch = { .count = 0 };
+    destroy_table(vm->pml4->entries, 4, &batch);
+    free_batch_add(&batch, vm->pml4);
+    frames_put_bulk(batch.count, batch.frames);
 
-            BUG_ON_ERROR(translate_address(vm, pg, &paddr));
-            
-            frame_free(paddr);
+    // The PCID of vm isn't reused until the next generation, which starts with a full TLB flush.
+    vm->pml4 = NULL;
+}
+
+// clone_table copies user page table src of the given level (3 for PDPT, 1 for the last level) into empty dst.
+// Frames mapped by the last level become shared: writable PTEs turn into read-only PTE_COW ones in both tables.
+static int clone_table(pte_t* dst, pte_t* src, int level) {
+    for (size_t i = 0; i < PTE_COUNT; i++) {
+        pte_t pte = src[i];
+        if (!pte_mapped(pte)) {
+            continue;
         }
 
-        object_free(&vmem_area_alloc, area);
+        if (level == 2 && (pte & PTE_PAGE_SIZE)) {
+            // Huge pages are shared as a whole and split on the first copy-on-write fault.
+            void* frames = PHYS_TO_VIRT(PTE_ADDR(pte));
+            if (pte & PTE_WRITE) {
+                pte = (pte & ~PTE_WRITE) | PTE_COW;
+                src[i] = pte;
+            }
+            for (size_t j = 0; j < HUGE_PAGE_PAGES; j++) {
+                frame_get(frames + j * PAGE_SIZE);
+            }
+            dst[i] = pte;
+            continue;
+        }
+
+        if (level > 1) {
+            // No 1 GiB user pages.
+            BUG_ON(pte & PTE_PAGE_SIZE);
+
+            pte_t* table = frame_alloc(FRAME_ZERO);
+            if (table == NULL) {
+                return -ENOMEM;
+            }
+            dst[i] = (uint64_t)VIRT_TO_PHYS(table) | (pte & PTE_FLAGS_MASK);
+
+            int err = clone_table(table, PHYS_TO_VIRT(PTE_ADDR(pte)), level - 1);
+            if (err < 0) {
+                return err;
+            }
+            continue;
+        }
+
+        void* frame = PHYS_TO_VIRT(PTE_ADDR(pte));
+        const frame_t* desc = frame_from_addr(frame);
+        if (desc && desc->chunk) {
+            // Only frames from the frame allocator are refcounted, e.g. user code lives in kernel sections.
+            if (pte & PTE_WRITE) {
+                pte = (pte & ~PTE_WRITE) | PTE_COW;
+                src[i] = pte;
+            }
+            frame_get(frame);
+        }
+        dst[i] = pte;
+    }
+
+    return 0;
+}
+
+// clone_areas copies the subtree of areas src into *dst, keeping its shape.
+static int clone_areas(vmem_area_t** dst, vmem_area_t* src) {
+    if (src == NULL) {
+        return 0;
+    }
+
+    vmem_area_t* copy = object_alloc(&vmem_area_alloc);
+    if (copy == NULL) {
+        return -ENOMEM;
     }
+    *copy = *src;
+    copy->left = NULL;
+    copy->right = NULL;
+    *dst = copy;
+
+    int err = clone_areas(&copy->left, src->left);
+    if (err < 0) {
+        return err;
+    }
+    return clone_areas(&copy->right, src->right);
 }
 
 int vmem_clone_from_current(vmem_t* dst, vmem_t* curr) {
-    // TODO: implement me. Notice that curr is an active address space, so you can directly access its virtual addresses.
+    BUG_ON_NULL(dst);
+    BUG_ON_NULL(curr);
+
+    // On failure dst is destroyed, so a partial copy of the tree is fine, as long as it's a valid tree.
+    int err = clone_areas(&dst->areas.root, curr->areas.root);
+    if (err < 0) {
+        return err;
+    }
+    dst->areas.count = curr->areas.count;
+
+    // Kernel half is shared and already set up by vmem_init_new.
+    for (size_t i = 0; i < KERNEL_PML4E_START; i++) {
+        pte_t pml4e = curr->pml4->entries[i];
+        if (!(pml4e & PTE_PRESENT)) {
+            continue;
+        }
+
+        pdpt_t* pdpt = frame_alloc(FRAME_ZERO);
+        if (pdpt == NULL) {
+            err = -ENOMEM;
+            break;
+        }
+        dst->pml4->entries[i] = (uint64_t)VIRT_TO_PHYS(pdpt) | (pml4e & PTE_FLAGS_MASK);
+
+        err = clone_table(pdpt->entries, PHYS_TO_VIRT(PTE_ADDR(pml4e)), 3);
+        if (err < 0) {
+            break;
+        }
+    }
+
+    // Some of the writable PTEs of curr became read-only.
+    vmem_flush_tlb(curr);
+
+    return err;
+}
+
+// pte_allows checks that leaf entry pte already permits an access with given VMEM_FAULT_* flags.
+static bool pte_allows(pte_t pte, uint64_t fault_flags) {
+    if ((fault_flags & VMEM_FAULT_WRITE) && !(pte & PTE_WRITE)) {
+        return false;
+    }
+    if ((fault_flags & VMEM_FAULT_USER) && !(pte & PTE_USER)) {
+        return false;
+    }
+    return true;
+}
+
+// frames_exclusive checks that pgcnt frames starting at frames belong to a single user and may be written to.
+static bool frames_exclusive(void* frames, size_t pgcnt) {
+    const frame_t* desc = frame_from_addr(frames);
+    if (desc == NULL || desc->chunk == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < pgcnt; i++) {
+        if (__atomic_load_n(&desc[i].refcount, __ATOMIC_ACQUIRE) != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// handle_cow_fault resolves a write fault on a copy-on-write page, copying the page if it is still shared.
+static int handle_cow_fault(pte_t* pte, void* virt_addr) {
+    void* frame = PHYS_TO_VIRT(PTE_ADDR(*pte));
+    const uint64_t flags = (*pte & PTE_FLAGS_MASK & ~PTE_COW) | PTE_WRITE;
+
+    if (frames_exclusive(frame, 1)) {
+        // Other users are gone, the frame can be taken over as is.
+        *pte = (uint64_t)VIRT_TO_PHYS(frame) | flags;
+    } else {
+        // Copies of the zero page come from the pool of zeroed frames instead.
+        const bool zero = frame == PHYS_TO_VIRT(zero_page_phys());
+        void* copy = frame_alloc(zero ? FRAME_ZERO : FRAME_NO_FLAGS);
+        if (copy == NULL) {
+            return -ENOMEM;
+        }
+        if (!zero) {
+            x86_movsq(copy, frame, PAGE_SIZE / sizeof(uint64_t));
+        }
+
+        *pte = (uint64_t)VIRT_TO_PHYS(copy) | flags;
+        put_frames(frame, 1);
+    }
+
+    x86_invlpg(virt_addr);
     return 0;
 }
 
-int vmem_init_new(vmem_t* vm) {
-    vm->pml4 = frame_alloc();
-    if (vm->pml4 == NULL) {
+int vmem_handle_fault(vmem_t* vm, void* virt_addr, uint64_t fault_flags) {
+    BUG_ON_NULL(vm);
+
+    vmem_area_t* area = find_area(vm, virt_addr);
+    if (area == NULL) {
+        return -EFAULT;
+    }
+    if ((fault_flags & VMEM_FAULT_WRITE) && !(area->flags & VMEM_WRITE)) {
+        return -EFAULT;
+    }
+    if ((fault_flags & VMEM_FAULT_USER) && !(area->flags & VMEM_USER)) {
+        return -EFAULT;
+    }
+
+    void* page = (void*)ALIGN_DOWN(virt_addr, PAGE_SIZE);
+
+    pte_t* pde = lookup_pde(vm, page);
+    if (pde != NULL && (*pde & PTE_PRESENT) && (*pde & PTE_PAGE_SIZE)) {
+        if (pte_allows(*pde, fault_flags)) {
+            return 0;
+        }
+        if (!(fault_flags & VMEM_FAULT_WRITE) || !(*pde & PTE_COW)) {
+            return -EFAULT;
+        }
+        // Only the written page gets copied, the rest of the huge page stays shared.
+        int err = split_huge_page(pde, (void*)ALIGN_DOWN(page, HUGE_PAGE_SIZE));
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    pte_t* pte = lookup_pte(vm, page);
+    if (pte != NULL && (*pte & PTE_PRESENT)) {
+        // Spurious faults, e.g. one which raced with another fault on the same page or hit a TLB entry
+        // from before the rights were raised. The fault itself drops the stale entry.
+        if (pte_allows(*pte, fault_flags)) {
+            return 0;
+        }
+        if ((fault_flags & VMEM_FAULT_WRITE) && (*pte & PTE_COW)) {
+            return handle_cow_fault(pte, page);
+        }
+        return -EFAULT;
+    }
+
+    // Reads of untouched pages see the zero page until the first write.
+    if (!(fault_flags & VMEM_FAULT_WRITE)) {
+        return map_zero_pages(vm, page, 1, area->flags);
+    }
+
+    // First write to a 2 MiB block, which lies within the area, maps the whole block at once.
+    void* huge_page = (void*)ALIGN_DOWN(page, HUGE_PAGE_SIZE);
+    if (huge_page >= area->start && huge_page + HUGE_PAGE_SIZE <= vmem_area_end(area) &&
+        map_huge_page(vm, huge_page, area->flags) == 0) {
+        return 0;
+    }
+
+    // First write to a reserved page.
+    void* frame = frame_alloc(FRAME_ZERO);
+    if (frame == NULL) {
         return -ENOMEM;
     }
-    memset(vm->pml4, '\0', sizeof(pml4_t));
-    vm->areas_head = NULL;
+
+    int err = vmem_map_page(vm, page, VIRT_TO_PHYS(frame), area->flags);
+    if (err < 0) {
+        frame_free(frame);
+        return err;
+    }
+
+    return 0;
+}
+
+// Frames of a run are allocated and mapped in batches of VMEM_POPULATE_BATCH, which bounds the array of frames
+// on the stack.
+#define VMEM_POPULATE_BATCH 32
+
+// populate_run backs pgcnt unmapped pages at virt_addr, which lie within a single page table, with zeroed frames.
+// A whole 2 MiB block gets a huge page if there is no page table for it yet.
+static int populate_run(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags) {
+    if (pgcnt == HUGE_PAGE_PAGES && map_huge_page(vm, virt_addr, flags) == 0) {
+        return 0;
+    }
+
+    void* frames[VMEM_POPULATE_BATCH];
+    while (pgcnt > 0) {
+        const size_t batch = pgcnt < VMEM_POPULATE_BATCH ? pgcnt : VMEM_POPULATE_BATCH;
+        if (frames_alloc_bulk(batch, frames, FRAME_ZERO) < 0) {
+            return -ENOMEM;
+        }
+        // Within a single page table nothing is mapped if this fails.
+        int err = vmem_map_pages(vm, virt_addr, frames, batch, flags);
+        if (err < 0) {
+            for (size_t i = 0; i < batch; i++) {
+                frame_free(frames[i]);
+            }
+            return err;
+        }
+        virt_addr += batch * PAGE_SIZE;
+        pgcnt -= batch;
+    }
+
+    return 0;
+}
+
+int vmem_populate_range(vmem_t* vm, void* virt_addr, size_t pgcnt) {
+    BUG_ON_NULL(vm);
+    BUG_ON(((uint64_t)virt_addr) % PAGE_SIZE);
+
+    void* end = virt_addr + pgcnt * PAGE_SIZE;
+    void* addr = virt_addr;
+    while (addr < end) {
+        vmem_area_t* area = find_area(vm, addr);
+        if (area == NULL) {
+            return -EFAULT;
+        }
+        const bool writable = area->flags & VMEM_WRITE;
+
+        // Inaccessible pages would fault anyway, so there is nothing to populate.
+        if (!(area->flags & VMEM_USER)) {
+            addr = vmem_area_end(area);
+            continue;
+        }
+
+        // Runs of unmapped pages end with the range, the area and the page table.
+        void* run_end = (void*)ALIGN_DOWN(addr, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+        if (run_end > end) {
+            run_end = end;
+        }
+        if (run_end > vmem_area_end(area)) {
+            run_end = vmem_area_end(area);
+        }
+
+        pte_t* pde = lookup_pde(vm, addr);
+        pgtbl_t* pgtbl = NULL;
+        pte_t entry = 0;
+        if (pde != NULL && (*pde & PTE_PRESENT)) {
+            if (*pde & PTE_PAGE_SIZE) {
+                entry = *pde;
+            } else {
+                pgtbl = PHYS_TO_VIRT(PTE_ADDR(*pde));
+                entry = pgtbl->entries[PTE_FROM_ADDR(addr)];
+            }
+        }
+
+        if (entry & PTE_PRESENT) {
+            // Shared pages of writable areas are copied, same as on the first write by the owner.
+            if (writable && !(entry & PTE_WRITE)) {
+                int err = vmem_handle_fault(vm, addr, VMEM_FAULT_PRESENT | VMEM_FAULT_WRITE | VMEM_FAULT_USER);
+                if (err < 0) {
+                    return err;
+                }
+                addr += PAGE_SIZE;
+            } else {
+                addr = (entry & PTE_PAGE_SIZE) ? run_end : addr + PAGE_SIZE;
+            }
+            continue;
+        }
+
+        size_t run = 1;
+        while (addr + run * PAGE_SIZE < run_end &&
+               !(pgtbl && (pgtbl->entries[PTE_FROM_ADDR(addr) + run] & PTE_PRESENT))) {
+            run++;
+        }
+
+        // Pages, which can't be written, only need the zero page.
+        int err = writable ? populate_run(vm, addr, run, area->flags) : map_zero_pages(vm, addr, run, area->flags);
+        if (err < 0) {
+            return err;
+        }
+        addr += run * PAGE_SIZE;
+    }
+
     return 0;
 }
 
-bool vmem_is_user_addr(vmem_t *vmem, void *virt_addr, size_t size) {
-    BUG_ON_NULL(vmem);
+// change_fn changes a mapped leaf entry, which maps pgcnt pages, see pte_mapped.
+typedef void (*change_fn)(pte_t* pte, size_t pgcnt, uint64_t arg, vmem_flush_batch_t* batch);
+
+// change_ptes applies fn to every mapped leaf entry within [start, end) and adds the changed pages to batch.
+// Huge pages crossing the bounds of the range must be split already, see isolate_range.
+static void change_ptes(vmem_t* vm, void* start, void* end, change_fn fn, uint64_t arg, vmem_flush_batch_t* batch) {
+    void* addr = start;
+    while (addr < end) {
+        void* huge_page = (void*)ALIGN_DOWN(addr, HUGE_PAGE_SIZE);
+        void* huge_page_end = huge_page + HUGE_PAGE_SIZE;
 
-    for (vmem_area_t *area = vmem->areas_head; area; area = area->next) {
-        // TODO: Account for cases of being covered by several pages
-        const bool contained_fully = (
-            area->start <= virt_addr && 
-            virt_addr + size <= area->start + area->pgcnt * PAGE_SIZE
-        );
+        // Regions without page tables are skipped as a whole, not 2 MiB at a time.
+        uint64_t span;
+        pte_t* pde = walk_pde(vm, addr, &span);
+        if (pde == NULL) {
+            addr = (void*)ALIGN_DOWN(addr, span) + span;
+            continue;
+        }
+        if (!pte_mapped(*pde)) {
+            addr = huge_page_end;
+            continue;
+        }
 
-        if (!contained_fully) {
+        if (*pde & PTE_PAGE_SIZE) {
+            BUG_ON(addr != huge_page || huge_page_end > end);
+            fn(pde, HUGE_PAGE_PAGES, arg, batch);
+            vmem_flush_batch_add(batch, addr);
+            addr = huge_page_end;
             continue;
         }
 
-        return area->flags & VMEM_USER;
+        pgtbl_t* pgtbl = PHYS_TO_VIRT(PTE_ADDR(*pde));
+        for (; addr < end && addr < huge_page_end; addr += PAGE_SIZE) {
+            pte_t* pte = &pgtbl->entries[PTE_FROM_ADDR(addr)];
+            if (pte_mapped(*pte)) {
+                fn(pte, 1, arg, batch);
+                vmem_flush_batch_add(batch, addr);
+            }
+        }
+    }
+}
+
+static void unmap_pte(pte_t* pte, size_t pgcnt, uint64_t arg, vmem_flush_batch_t* batch) {
+    UNUSED(arg);
+
+    void* frames = PHYS_TO_VIRT(PTE_ADDR(*pte));
+    *pte = 0;
+    flush_batch_free(batch, frames, pgcnt);
+}
+
+static void protect_pte(pte_t* pte, size_t pgcnt, uint64_t pte_flags, vmem_flush_batch_t* batch) {
+    UNUSED(batch);
+
+    pte_t entry = *pte & ~(PTE_PRESENT | PTE_USER | PTE_WRITE | PTE_COW | PTE_PROTNONE);
+    if (!(pte_flags & PTE_USER)) {
+        // Pages without user access aren't present at all, so the kernel can't touch them on behalf of the task
+        // either: uaccess faults on them and gets -EFAULT from the fault handler, as for unmapped memory.
+        *pte = entry | PTE_PROTNONE;
+        return;
+    }
+
+    entry |= PTE_PRESENT | PTE_USER;
+    if (pte_flags & PTE_WRITE) {
+        // Shared frames stay read-only and get copied on the first write.
+        entry |= frames_exclusive(PHYS_TO_VIRT(PTE_ADDR(*pte)), pgcnt) ? PTE_WRITE : PTE_COW;
+    }
+    *pte = entry;
+}
+
+// split_area splits area at virt_addr, which must be inside it, and returns the upper part.
+static vmem_area_t* split_area(vmem_t* vm, vmem_area_t* area, void* virt_addr) {
+    vmem_area_t* upper = object_alloc(&vmem_area_alloc);
+    if (upper == NULL) {
+        return NULL;
+    }
+
+    vmem_tree_remove(&vm->areas, area);
+    upper->start = virt_addr;
+    upper->pgcnt = (vmem_area_end(area) - virt_addr) / PAGE_SIZE;
+    upper->flags = area->flags;
+    area->pgcnt -= upper->pgcnt;
+    vmem_tree_insert(&vm->areas, area);
+    vmem_tree_insert(&vm->areas, upper);
+
+    return upper;
+}
+
+// split_huge_page_at splits the huge page containing virt_addr, unless there is none or it starts at virt_addr.
+static int split_huge_page_at(vmem_t* vm, void* virt_addr) {
+    if ((uint64_t)virt_addr % HUGE_PAGE_SIZE == 0) {
+        return 0;
+    }
+
+    pte_t* pde = lookup_pde(vm, virt_addr);
+    if (pde == NULL || !pte_mapped(*pde) || !(*pde & PTE_PAGE_SIZE)) {
+        return 0;
     }
-    
-    return false;
+    return split_huge_page(pde, (void*)ALIGN_DOWN(virt_addr, HUGE_PAGE_SIZE));
+}
+
+// isolate_range splits areas and huge pages crossing the bounds of [start, end), so each of them is either inside
+// the range or outside. Changes of the range can't fail after that.
+static int isolate_range(vmem_t* vm, void* start, void* end) {
+    int err = split_huge_page_at(vm, start);
+    if (err < 0) {
+        return err;
+    }
+    err = split_huge_page_at(vm, end);
+    if (err < 0) {
+        return err;
+    }
+
+    vmem_area_t* area = vmem_tree_find(&vm->areas, start);
+    if (area && area->start < start && split_area(vm, area, start) == NULL) {
+        return -ENOMEM;
+    }
+    area = vmem_tree_find(&vm->areas, end);
+    if (area && area->start < end && split_area(vm, area, end) == NULL) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// merge_with_prev merges area into the previous one, if they are adjacent and have the same flags.
+// Returns the resulting area.
+static vmem_area_t* merge_with_prev(vmem_t* vm, vmem_area_t* area) {
+    vmem_area_t* prev = vmem_tree_prev(&vm->areas, area->start);
+    if (prev == NULL || vmem_area_end(prev) != area->start || prev->flags != area->flags) {
+        return area;
+    }
+
+    vmem_tree_remove(&vm->areas, area);
+    vmem_tree_remove(&vm->areas, prev);
+    prev->pgcnt += area->pgcnt;
+    vmem_tree_insert(&vm->areas, prev);
+    object_free(&vmem_area_alloc, area);
+
+    return prev;
+}
+
+int vmem_unmap_range(vmem_t* vm, void* virt_addr, size_t pgcnt) {
+    BUG_ON_NULL(vm);
+    BUG_ON(((uint64_t)virt_addr) % PAGE_SIZE);
+
+    void* end = virt_addr + pgcnt * PAGE_SIZE;
+    int err = isolate_range(vm, virt_addr, end);
+    if (err < 0) {
+        return err;
+    }
+
+    vmem_area_t* area = NULL;
+    while ((area = vmem_tree_next(&vm->areas, virt_addr)) != NULL && area->start < end) {
+        vmem_tree_remove(&vm->areas, area);
+        object_free(&vmem_area_alloc, area);
+    }
+
+    vmem_flush_batch_t batch;
+    vmem_flush_batch_init(&batch, vm);
+    change_ptes(vm, virt_addr, end, unmap_pte, 0, &batch);
+    vmem_flush_batch_apply(&batch);
+
+    return 0;
+}
+
+int vmem_protect_range(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags) {
+    BUG_ON_NULL(vm);
+    BUG_ON(((uint64_t)virt_addr) % PAGE_SIZE);
+
+    void* end = virt_addr + pgcnt * PAGE_SIZE;
+    for (void* addr = virt_addr; addr < end;) {
+        vmem_area_t* area = vmem_tree_find(&vm->areas, addr);
+        if (area == NULL) {
+            return -EFAULT;
+        }
+        addr = vmem_area_end(area);
+    }
+
+    int err = isolate_range(vm, virt_addr, end);
+    if (err < 0) {
+        return err;
+    }
+
+    for (void* addr = virt_addr; addr < end;) {
+        vmem_area_t* area = vmem_tree_find(&vm->areas, addr);
+        area->flags = flags;
+        area = merge_with_prev(vm, area);
+        addr = vmem_area_end(area);
+    }
+    vmem_area_t* next = vmem_tree_find(&vm->areas, end);
+    if (next != NULL) {
+        merge_with_prev(vm, next);
+    }
+
+    vmem_flush_batch_t batch;
+    vmem_flush_batch_init(&batch, vm);
+    change_ptes(vm, virt_addr, end, protect_pte, convert_flags(flags), &batch);
+    vmem_flush_batch_apply(&batch);
+
+    return 0;
+}
+
+// Template of the kernel half, its entries are copied to every new address space, so the tables below are shared.
+// All kernel mappings live within these entries, so the copies never go out of sync.
+static pml4_t* kernel_pml4 = NULL;
+
+void vmem_init_kernel() {
+    kernel_pml4 = frame_alloc(FRAME_ZERO);
+    if (kernel_pml4 == NULL) {
+        panic("cannot allocate kernel PML4");
+    }
+    vmem_t kernel_vm = { .pml4 = kernel_pml4 };
+
+    // Setup direct physical mapping.
+    uint8_t* virt_addr = (uint8_t*)KERNEL_DIRECT_PHYS_MAPPING_START;
+    uint8_t* phys_addr = (uint8_t*)0;
+    for (size_t i = 0; i < (KERNEL_DIRECT_PHYS_MAPPING_SIZE / GB); i++) {
+        if (vmem_map_1gb_page(&kernel_vm, virt_addr, phys_addr, VMEM_WRITE | VMEM_GLOBAL) < 0) {
+            panic("cannot allocate direct mapping page tables");
+        }
+        virt_addr += GB;
+        phys_addr += GB;
+    }
+
+    // Setup kernel sections mapping.
+    uint8_t* virt_addr_curr = (uint8_t*)KERNEL_SECTIONS_START;
+    uint8_t* phys_addr_curr = (uint8_t*)&_phys_start_hh;
+    uint8_t* phys_addr_end = (uint8_t*)&_phys_end_kernel_sections;
+    while (phys_addr_curr < phys_addr_end) {
+        if (vmem_map_2mb_page(&kernel_vm, virt_addr_curr, phys_addr_curr, VMEM_WRITE | VMEM_GLOBAL) < 0) {
+            panic("cannot allocate kernel sections page tables");
+        }
+        phys_addr_curr += 2 * MB;
+        virt_addr_curr += 2 * MB;
+    }
+
+    for (size_t i = 0; i < KERNEL_PML4E_START; i++) {
+        BUG_ON(kernel_pml4->entries[i] & PTE_PRESENT);
+    }
+}
+
+int vmem_init_new(vmem_t* vm) {
+    BUG_ON_NULL(kernel_pml4);
+
+    vm->pml4 = frame_alloc(FRAME_ZERO);
+    if (vm->pml4 == NULL) {
+        return -ENOMEM;
+    }
+    for (size_t i = KERNEL_PML4E_START; i < PTE_COUNT; i++) {
+        vm->pml4->entries[i] = kernel_pml4->entries[i];
+    }
+
+    vm->areas = (vmem_tree_t){};
+    vm->pcid = 0;
+    vm->pcid_generation = 0;
+    return 0;
 }
@@ -1,40 +1,107 @@
 #pragma once
 
 #include "paging.h"
+#include "vmem_tree.h"
 #include "arch/x86/x86.h"
 
 #define VMEM_NO_FLAGS 0
 #define VMEM_USER     (1 << 0)
 #define VMEM_WRITE    (1 << 1)
+// Mapping is the same in all address spaces, i.e. it's a kernel one, and survives address space switches in TLB.
+#define VMEM_GLOBAL   (1 << 2)
 
-typedef struct vmem_area {
-    void *start;
-    size_t pgcnt;
-    uint64_t flags;
-    struct vmem_area *next;
-} vmem_area_t;
+// Page fault flags.
+// The page is present, i.e. the fault is caused by access rights.
+#define VMEM_FAULT_PRESENT (1 << 0)
+#define VMEM_FAULT_WRITE   (1 << 1)
+// The access comes from user mode.
+#define VMEM_FAULT_USER    (1 << 2)
 
 // vmem_t is used to manage an address space, including all its page tables.
 typedef struct vmem {
     pml4_t *pml4;
-    vmem_area_t *areas_head;
+    vmem_tree_t areas;
+    // PCID tagging TLB entries of the address space, valid while pcid_generation is the current one.
+    uint16_t pcid;
+    uint64_t pcid_generation;
 } vmem_t;
 
+// Pages invalidated one by one, bigger batches flush the whole TLB of the address space.
+#define VMEM_FLUSH_BATCH_PAGES  16
+// Unmapped frame ranges kept until the flush, more of them apply the batch early.
+#define VMEM_FLUSH_BATCH_FRAMES 16
+
+// vmem_flush_batch_t collects TLB invalidations of an address space, so they are applied at once after its page
+// tables are changed. Frames unmapped along the way are released only after the flush, since until then
+// the TLB may still refer to them.
+typedef struct vmem_flush_batch {
+    vmem_t *vm;
+    void *pages[VMEM_FLUSH_BATCH_PAGES];
+    size_t page_count;
+    bool flush_all;
+    struct {
+        void *frames;
+        size_t pgcnt;
+    } freed[VMEM_FLUSH_BATCH_FRAMES];
+    size_t freed_count;
+} vmem_flush_batch_t;
+
+// vmem_flush_batch_init starts an empty batch of vm.
+void vmem_flush_batch_init(vmem_flush_batch_t* batch, vmem_t* vm);
+
+// vmem_flush_batch_add adds a changed page at virt_addr to the batch. A huge page is added by any of its addresses.
+void vmem_flush_batch_add(vmem_flush_batch_t* batch, void* virt_addr);
+
+// vmem_flush_batch_apply invalidates the collected pages, releases the unmapped frames and empties the batch.
+void vmem_flush_batch_apply(vmem_flush_batch_t* batch);
+
 // vmem_init_from_cr3 initializes vmem from current address space.
 void vmem_init_from_current(vmem_t* vm);
 
-// vmem_init_new initialized new vmem.
+// vmem_init_kernel builds page tables of the kernel half, which are shared by all address spaces created
+// with vmem_init_new. Must be called once, after the frame allocator is initialized.
+void vmem_init_kernel();
+
+// vmem_init_new initialized new vmem. Only its PML4 is allocated, the kernel half of it refers to the shared tables.
 int vmem_init_new(vmem_t* vm);
 
 // vmem_destroy destroys givem vmem and releases all allocated areas.
 void vmem_destroy(vmem_t* vm);
 
-// vmem_switch_to switches to the specified address space.
+// vmem_switch_to switches to the specified address space. TLB entries of vm are kept from its last run, if possible.
 void vmem_switch_to(vmem_t* vm);
 
-// vmem_alloc_pages allocates pgcnt frames and then maps it to the virtual address virt_addr.
+// vmem_flush_tlb drops cached translations of vm, which are stale after some of its mappings were changed.
+// Global ones are kept, see vmem_flush_kernel_tlb.
+void vmem_flush_tlb(vmem_t* vm);
+
+// vmem_flush_kernel_tlb drops all cached translations, including global ones. Needed after kernel mappings change.
+void vmem_flush_kernel_tlb();
+
+// vmem_reserve_pages reserves pgcnt pages at virt_addr without populating them. Frames are allocated and mapped
+// by vmem_handle_fault when the pages are touched.
+int vmem_reserve_pages(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags);
+
+// vmem_alloc_pages reserves pgcnt pages at virt_addr and populates them right away, see vmem_populate_range.
 int vmem_alloc_pages(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags);
 
+// vmem_populate_range faults in pgcnt pages at virt_addr, which must be covered by areas of vm, ahead of their
+// first touch. Writable pages get private frames, read-only ones map the zero page and inaccessible ones,
+// i.e. without VMEM_USER, are skipped.
+int vmem_populate_range(vmem_t* vm, void* virt_addr, size_t pgcnt);
+
+// vmem_unmap_range removes pgcnt pages at virt_addr from areas of vm and unmaps them, releasing their frames.
+// Pages, which aren't mapped, are skipped.
+int vmem_unmap_range(vmem_t* vm, void* virt_addr, size_t pgcnt);
+
+// vmem_protect_range changes flags of pgcnt pages at virt_addr, which must be covered by areas of vm.
+// Returns -EFAULT otherwise. Pages without VMEM_USER become non-present, but keep their frames until unmapped.
+int vmem_protect_range(vmem_t* vm, void* virt_addr, size_t pgcnt, uint64_t flags);
+
+// vmem_find_free_range returns the lowest address within [low, high), where pgcnt pages aren't taken by any area,
+// or NULL if there is no such range.
+void* vmem_find_free_range(vmem_t* vm, size_t pgcnt, void* low, void* high);
+
 // vmem_map_1gb_page maps 1GB page to specified virt_addr.
 int vmem_map_1gb_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t flags);
 
@@ -44,7 +111,16 @@ int vmem_map_2mb_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t fla
 // vmem_map_page maps single page to specified virt_addr with given PTE flags.
 int vmem_map_page(vmem_t* vm, void* virt_addr, void* phys_addr, uint64_t flags);
 
-// vmem_copy_from_current copies all allocated areas from curr to dst, assuming that curr is an active address space.
+// vmem_map_pages maps pgcnt pages starting at virt_addr to given frames, which are direct mapping addresses
+// as returned by the frame allocator. Page tables are walked once per 512 pages instead of once per page.
+int vmem_map_pages(vmem_t* vm, void* virt_addr, void** frames, size_t pgcnt, uint64_t flags);
+
+// vmem_clone_from_current copies all allocated areas from curr to dst, assuming that curr is an active address space
+// and dst is a new one. User pages aren't copied: both address spaces share their frames, and writable ones become
+// copy-on-write. Kernel half page tables are shared as is.
 int vmem_clone_from_current(vmem_t* dst, vmem_t* curr);
 
-bool vmem_is_user_addr(vmem_t *vmem, void *virt_addr, size_t size);
+// vmem_handle_fault resolves a page fault at virt_addr with given VMEM_FAULT_* flags: maps the shared zero page
+// on first read of a reserved page, populates it on first write and copies copy-on-write pages on write.
+// Returns -EFAULT if the access isn't allowed.
+int vmem_handle_fault(vmem_t* vm, void* virt_addr, uint64_t fault_flags);
@@ -0,0 +1,226 @@
+#include "vmem_tree.h"
+#include "kernel/panic.h"
+
+static inline int height(const vmem_area_t* node) {
+    return node ? node->height : 0;
+}
+
+// update recomputes the height and the subtree data of node from its children.
+static void update(vmem_area_t* node) {
+    vmem_area_t* left = node->left;
+    vmem_area_t* right = node->right;
+
+    node->height = 1 + (height(left) > height(right) ? height(left) : height(right));
+    node->subtree_start = left ? left->subtree_start : node->start;
+    node->subtree_end = right ? right->subtree_end : vmem_area_end(node);
+
+    size_t gap = 0;
+    if (left) {
+        gap = left->subtree_gap;
+        if ((size_t)(node->start - left->subtree_end) > gap) {
+            gap = node->start - left->subtree_end;
+        }
+    }
+    if (right) {
+        if (right->subtree_gap > gap) {
+            gap = right->subtree_gap;
+        }
+        if ((size_t)(right->subtree_start - vmem_area_end(node)) > gap) {
+            gap = right->subtree_start - vmem_area_end(node);
+        }
+    }
+    node->subtree_gap = gap;
+}
+
+static vmem_area_t* rotate_right(vmem_area_t* node) {
+    vmem_area_t* left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update(node);
+    update(left);
+    return left;
+}
+
+static vmem_area_t* rotate_left(vmem_area_t* node) {
+    vmem_area_t* right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update(node);
+    update(right);
+    return right;
+}
+
+// balance restores the AVL invariant at node, whose subtrees are balanced, and returns the new subtree root.
+static vmem_area_t* balance(vmem_area_t* node) {
+    update(node);
+
+    const int diff = height(node->left) - height(node->right);
+    if (diff > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (diff < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static vmem_area_t* insert_area(vmem_area_t* node, vmem_area_t* area) {
+    if (node == NULL) {
+        return area;
+    }
+
+    if (vmem_area_end(area) <= node->start) {
+        node->left = insert_area(node->left, area);
+    } else {
+        BUG_ON(area->start < vmem_area_end(node));
+        node->right = insert_area(node->right, area);
+    }
+    return balance(node);
+}
+
+void vmem_tree_insert(vmem_tree_t* tree, vmem_area_t* area) {
+    BUG_ON_NULL(tree);
+    BUG_ON_NULL(area);
+
+    area->left = NULL;
+    area->right = NULL;
+    update(area);
+
+    tree->root = insert_area(tree->root, area);
+    tree->count++;
+}
+
+// remove_min unlinks the lowest area of the subtree into *min and returns the new subtree root.
+static vmem_area_t* remove_min(vmem_area_t* node, vmem_area_t** min) {
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+    node->left = remove_min(node->left, min);
+    return balance(node);
+}
+
+static vmem_area_t* remove_area(vmem_area_t* node, vmem_area_t* area) {
+    BUG_ON_NULL(node);
+
+    if (area->start < node->start) {
+        node->left = remove_area(node->left, area);
+    } else if (area->start > node->start) {
+        node->right = remove_area(node->right, area);
+    } else {
+        BUG_ON(node != area);
+
+        if (node->right == NULL) {
+            return node->left;
+        }
+
+        vmem_area_t* successor = NULL;
+        vmem_area_t* right = remove_min(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        node = successor;
+    }
+    return balance(node);
+}
+
+void vmem_tree_remove(vmem_tree_t* tree, vmem_area_t* area) {
+    BUG_ON_NULL(tree);
+    BUG_ON_NULL(area);
+
+    tree->root = remove_area(tree->root, area);
+    tree->count--;
+}
+
+vmem_area_t* vmem_tree_find(vmem_tree_t* tree, void* addr) {
+    BUG_ON_NULL(tree);
+
+    vmem_area_t* node = tree->root;
+    while (node) {
+        if (addr < node->start) {
+            node = node->left;
+        } else if (addr >= vmem_area_end(node)) {
+            node = node->right;
+        } else {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+vmem_area_t* vmem_tree_next(vmem_tree_t* tree, void* addr) {
+    BUG_ON_NULL(tree);
+
+    // Areas don't overlap, so their ends are ordered the same way as their starts.
+    vmem_area_t* found = NULL;
+    vmem_area_t* node = tree->root;
+    while (node) {
+        if (vmem_area_end(node) > addr) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+vmem_area_t* vmem_tree_prev(vmem_tree_t* tree, void* addr) {
+    BUG_ON_NULL(tree);
+
+    vmem_area_t* found = NULL;
+    vmem_area_t* node = tree->root;
+    while (node) {
+        if (node->start < addr) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+// find_gap looks for the lowest free range of size bytes in the subtree of node, which starts at *cursor or after it.
+// *cursor is the end of the areas seen so far and is moved past the subtree if nothing is found there.
+static bool find_gap(vmem_area_t* node, void** cursor, size_t size) {
+    if (node == NULL || node->subtree_end <= *cursor) {
+        return false;
+    }
+
+    // Skip the whole subtree if neither the space before it nor any gap inside it is big enough.
+    const size_t before = node->subtree_start > *cursor ? (size_t)(node->subtree_start - *cursor) : 0;
+    if (before < size && node->subtree_gap < size) {
+        *cursor = node->subtree_end;
+        return false;
+    }
+
+    if (find_gap(node->left, cursor, size)) {
+        return true;
+    }
+    if (node->start >= *cursor && (size_t)(node->start - *cursor) >= size) {
+        return true;
+    }
+    if (vmem_area_end(node) > *cursor) {
+        *cursor = vmem_area_end(node);
+    }
+    return find_gap(node->right, cursor, size);
+}
+
+void* vmem_tree_find_gap(vmem_tree_t* tree, size_t size, void* low, void* high) {
+    BUG_ON_NULL(tree);
+
+    void* cursor = low;
+    find_gap(tree->root, &cursor, size);
+
+    // Either the lowest gap between areas or the space after the last one.
+    if (cursor >= high || (size_t)(high - cursor) < size) {
+        return NULL;
+    }
+    return cursor;
+}
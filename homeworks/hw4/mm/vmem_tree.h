@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+#include "defs.h"
+
+/**
+ * Areas of an address space never overlap, so they are kept in an AVL tree ordered by start address.
+ * Each node also describes its whole subtree: the lowest start, the highest end and the largest gap
+ * between two neighbouring areas inside it. Updating these takes O(1) per node on the way back from
+ * an insertion or a removal, and lets the gap search skip subtrees without enough free space, so
+ * lookups, updates and gap searches are all O(log n).
+ */
+
+// vmem_area_t is a range of virtual memory owned by an address space. Its pages may be not populated yet,
+// the page fault handler maps them on first touch.
+typedef struct vmem_area {
+    void *start;
+    size_t pgcnt;
+    uint64_t flags;
+    struct vmem_area *left,
+                     *right;
+    // Bounds of the subtree and the largest free gap between its areas.
+    void *subtree_start,
+         *subtree_end;
+    size_t subtree_gap;
+    int height;
+} vmem_area_t;
+
+typedef struct vmem_tree {
+    vmem_area_t *root;
+    size_t count;
+} vmem_tree_t;
+
+// vmem_area_end returns the address just after the last page of area.
+static inline void* vmem_area_end(const vmem_area_t* area) {
+    return area->start + area->pgcnt * PAGE_SIZE;
+}
+
+// vmem_tree_insert inserts area into tree. The area must not overlap with the ones already there.
+void vmem_tree_insert(vmem_tree_t* tree, vmem_area_t* area);
+
+// vmem_tree_remove removes area from tree.
+void vmem_tree_remove(vmem_tree_t* tree, vmem_area_t* area);
+
+// vmem_tree_find returns the area containing addr, or NULL if there is none.
+vmem_area_t* vmem_tree_find(vmem_tree_t* tree, void* addr);
+
+// vmem_tree_next returns the lowest area ending after addr, i.e. the one containing addr or the first one after it.
+vmem_area_t* vmem_tree_next(vmem_tree_t* tree, void* addr);
+
+// vmem_tree_prev returns the highest area starting before addr.
+vmem_area_t* vmem_tree_prev(vmem_tree_t* tree, void* addr);
+
+// vmem_tree_find_gap returns the lowest address of a free range of size bytes within [low, high),
+// or NULL if there is no such range.
+void* vmem_tree_find_gap(vmem_tree_t* tree, size_t size, void* low, void* high);
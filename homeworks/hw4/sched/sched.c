@@ -5,6 +5,7 @@
 #include "kernel/errno.h"
 #include "kernel/irq.h"
 #include "kernel/panic.h"
+#include "kernel/uaccess.h"
 #include "linker.h"
 #include "mm/frame_alloc.h"
 #include "mm/obj.h"
@@ -17,38 +18,15 @@ task_t tasks[MAX_TASK_COUNT] = {};
 extern void jump_userspace();
 
 static int setup_vmem(vmem_t* vm) {
-    // Setup direct physical mapping.
-    uint8_t* virt_addr = (uint8_t*)KERNEL_DIRECT_PHYS_MAPPING_START;
-    uint8_t* phys_addr = (uint8_t*)0;
-    for (size_t i = 0; i < (KERNEL_DIRECT_PHYS_MAPPING_SIZE / GB); i++) {
-        int err = vmem_map_1gb_page(vm, virt_addr, phys_addr, VMEM_WRITE);
-        if (err < 0) {
-            return err;
-        }
-        virt_addr += GB;
-        phys_addr += GB;
-    }
-
-    // Setup kernel sections mapping.
-    uint8_t* virt_addr_curr = (uint8_t*)KERNEL_SECTIONS_START;
-    uint8_t* phys_addr_curr = (uint8_t*)&_phys_start_hh;
-    uint8_t* phys_addr_end = (uint8_t*)&_phys_end_kernel_sections;
-    while (phys_addr_curr < phys_addr_end) {
-        int err = vmem_map_2mb_page(vm, virt_addr_curr, phys_addr_curr, VMEM_WRITE);
-        if (err < 0) {
-            return err;
-        }
-        phys_addr_curr += 2 * MB;
-        virt_addr_curr += 2 * MB;
-    }
-
+    // Kernel half is already there, see vmem_init_kernel.
     // Setup user-space code.
     int err = vmem_map_page(vm, (void*)0x10000, &_phys_start_user, VMEM_USER);
     if (err < 0) {
         return err;
     }
 
-    return 0;
+    // The page is already mapped, the area only marks it as taken and read-only for mmap and munmap.
+    return vmem_reserve_pages(vm, (void*)0x10000, 1, VMEM_USER);
 }
 
 static task_t* allocate_task() {
@@ -80,8 +58,8 @@ static int setup_init_task() {
         return err;
     }
 
-    // Setup user-space stack.
-    err = vmem_alloc_pages(&new_task->vmem, (void*)0x70000000, 4, VMEM_USER | VMEM_WRITE);
+    // Setup user-space stack, its pages are populated on first touch.
+    err = vmem_reserve_pages(&new_task->vmem, (void*)0x70000000, 4, VMEM_USER | VMEM_WRITE);
     if (err < 0) {
         return err;
     }
@@ -143,7 +121,11 @@ void sched_start() {
         }
 
         if (!found) {
-            // If we didn't found a runnable task, wait for next interrupt and retry scheduling.
+            // If we didn't found a runnable task, use the time to finish frame allocator initialization
+            // and prepare zeroed frames, then wait for next interrupt and retry scheduling.
+            if (!frame_alloc_deferred_init()) {
+                frame_zero_pool_refill();
+            }
             x86_hlt();
         }
     }
@@ -200,10 +182,36 @@ int64_t sys_sleep(arch_regs_t* regs) {
 }
 
 int64_t sys_fork(arch_regs_t* parent_regs) {
-    // TODO: implement me.
-    UNUSED(parent_regs);
+    BUG_ON_NULL(_current);
+
+    task_t* child = allocate_task();
+    if (child == NULL) {
+        return -ENOMEM;
+    }
+
+    int err = vmem_init_new(&child->vmem);
+    if (err < 0) {
+        return err;
+    }
+
+    // User pages are shared copy-on-write, so this is proportional to the size of page tables.
+    err = vmem_clone_from_current(&child->vmem, &_current->vmem);
+    if (err < 0) {
+        vmem_destroy(&child->vmem);
+        return err;
+    }
+
+    arch_regs_t* child_regs = NULL;
+    err = arch_thread_clone(&child->arch_thread, &child_regs, &_current->arch_thread);
+    if (err < 0) {
+        vmem_destroy(&child->vmem);
+        return err;
+    }
+    arch_regs_init_fork(child_regs, parent_regs);
 
-    return -EINVAL;
+    child->state = TASK_RUNNABLE;
+
+    return child->pid;
 }
 
 int64_t sys_getpid(arch_regs_t* regs) {
@@ -214,6 +222,17 @@ int64_t sys_getpid(arch_regs_t* regs) {
     return _current->pid;
 }
 
+void sched_exit(int exitcode) {
+    BUG_ON_NULL(_current);
+
+    _current->state = TASK_ZOMBIE;
+    _current->exitcode = exitcode;
+
+    sched_switch();
+
+    BUG_ON_REACH();
+}
+
 /*_Noreturn*/ int64_t sys_exit(arch_regs_t* regs) {
     uint64_t exitcode = syscall_arg0(regs);
 
@@ -221,15 +240,9 @@ int64_t sys_getpid(arch_regs_t* regs) {
         return -EINVAL;
     }
 
-    BUG_ON_NULL(_current);
-
-    _current->state = TASK_ZOMBIE;
-    _current->exitcode = (int)exitcode;
-
     printk("sys_exit %d\n", (int)exitcode);
 
-    sched_switch();
-
+    sched_exit((int)exitcode);
     BUG_ON_REACH();
 }
 
@@ -249,12 +262,10 @@ int64_t sys_wait(arch_regs_t* regs) {
         sched_switch();
     }
 
-    if (!vmem_is_user_addr(&_current->vmem, status, sizeof(int))) {
-        return -EINVAL;
+    if (put_user(task->exitcode, status) != 0) {
+        return -EFAULT;
     }
 
-    *status = task->exitcode;
-
     release_task(task);
 
     return 0;
@@ -34,5 +34,8 @@ void sched_start();
 void sched_switch();
 void sched_timer_tick();
 
+// sched_exit turns the current task into a zombie with given exit code and never returns.
+void sched_exit(int exitcode);
+
 extern task_t* _current;
 #define sched_current() _current
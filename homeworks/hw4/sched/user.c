@@ -34,7 +34,7 @@ USER_TEXT int64_t exit(uint64_t code) {
 
 USER_TEXT int64_t wait(uint64_t pid, int *status) {
     int64_t res;
-    SYSCALL2(SYS_EXIT, pid, status, res);
+    SYSCALL2(SYS_WAIT, pid, status, res);
     return res;
 }
 